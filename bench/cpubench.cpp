@@ -0,0 +1,143 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+// Measures total CPU time (all threads) per message for inserting a
+// dataset and reading back all aggregates, using either EmptyMethod, and the
+// wall-clock time from the end of insertion to the first batch and the last
+// record read, using either FinalizeMethod.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "CompressTree.h"
+#include "HashUtil.h"
+#include "Message.h"
+
+namespace {
+    const uint32_t kKeyLen = 12;
+    const uint32_t kMessagesPerInsert = 100000;
+
+    double Seconds(const timeval& t) {
+        return t.tv_sec + t.tv_usec / 1000000.0;
+    }
+
+    double CPUSeconds() {
+        rusage r;
+        getrusage(RUSAGE_SELF, &r);
+        return Seconds(r.ru_utime) + Seconds(r.ru_stime);
+    }
+
+    double WallSeconds() {
+        timeval t;
+        gettimeofday(&t, NULL);
+        return Seconds(t);
+    }
+
+    void GenerateMessages(gpucbt::Message* msgs, uint64_t num,
+            uint32_t uniq) {
+        char word[kKeyLen + 1];
+        for (uint64_t i = 0; i < num; ++i) {
+            snprintf(word, kKeyLen + 1, "%u", rand() % uniq);
+            msgs[i].set_hash(HashUtil::MurmurHash(word, strlen(word), 42));
+            msgs[i].set_key(word, kKeyLen + 1);
+            msgs[i].set_value(1);
+        }
+    }
+}
+
+#define USAGE "%s <sort|partition> <Number of messages> " \
+        "<Number of unique keys> [flush|merge]\n"
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        fprintf(stdout, USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    gpucbt::EmptyMethod method;
+    if (!strcmp(argv[1], "sort")) {
+        method = gpucbt::SORT_AND_SPLIT;
+    } else if (!strcmp(argv[1], "partition")) {
+        method = gpucbt::PARTITION;
+    } else {
+        fprintf(stdout, USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    gpucbt::FinalizeMethod finalize = gpucbt::FLUSH_TO_LEAVES;
+    const char* finalize_name = "flush";
+    if (argc > 4) {
+        finalize_name = argv[4];
+        if (!strcmp(argv[4], "merge")) {
+            finalize = gpucbt::MERGE_ON_READ;
+        } else if (strcmp(argv[4], "flush")) {
+            fprintf(stdout, USAGE, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t num_messages = strtoull(argv[2], NULL, 10);
+    uint32_t uniq = atoi(argv[3]);
+
+    // generate the whole dataset up front so that it isn't measured
+    gpucbt::Message* msgs = new gpucbt::Message[num_messages];
+    GenerateMessages(msgs, num_messages, uniq);
+
+    gpucbt::CompressTree* cbt = new gpucbt::CompressTree(8, 31457280,
+            method, finalize);
+    double cpu_start = CPUSeconds();
+    double wall_start = WallSeconds();
+    for (uint64_t ins = 0; ins < num_messages; ins += kMessagesPerInsert) {
+        uint64_t n = num_messages - ins;
+        cbt->bulk_insert(msgs + ins, n < kMessagesPerInsert? n :
+                kMessagesPerInsert);
+    }
+    double cpu_insert = CPUSeconds();
+    double wall_insert = WallSeconds();
+
+    gpucbt::Message* out = new gpucbt::Message[kMessagesPerInsert];
+    uint64_t num_read = 0, n;
+    double wall_first = 0;
+    bool more = true;
+    while (more) {
+        more = cbt->bulk_read(out, n, kMessagesPerInsert);
+        if (num_read == 0)
+            wall_first = WallSeconds();
+        num_read += n;
+    }
+    double cpu_end = CPUSeconds();
+    double wall_end = WallSeconds();
+
+    fprintf(stdout, "method: %s, finalize: %s, messages: %lu, "
+            "aggregates read: %lu\n", argv[1], finalize_name, num_messages,
+            num_read);
+    fprintf(stdout, "wall: %.3f s, cpu: %.3f s (insert: %.3f s, "
+            "flush+read: %.3f s)\n", wall_end - wall_start,
+            cpu_end - cpu_start, cpu_insert - cpu_start,
+            cpu_end - cpu_insert);
+    fprintf(stdout, "time to first batch: %.3f s, to last record: %.3f s\n",
+            wall_first - wall_insert, wall_end - wall_insert);
+    fprintf(stdout, "cpu per message: %.1f ns\n",
+            (cpu_end - cpu_start) * 1e9 / num_messages);
+    delete[] msgs;
+    delete[] out;
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "BloomFilter.h"
+#include "HashUtil.h"
+
+namespace gpucbt {
+    BloomFilter::BloomFilter() :
+            mask_(0) {
+    }
+
+    BloomFilter::~BloomFilter() {
+    }
+
+    void BloomFilter::Reset(uint32_t num) {
+        uint64_t nbits = 64;
+        while (nbits < static_cast<uint64_t>(num) * kBitsPerElement &&
+                nbits < (1ULL << 32))
+            nbits <<= 1;
+        bits_.assign(nbits / 64, 0);
+        mask_ = nbits - 1;
+    }
+
+    void BloomFilter::Add(uint32_t hash) {
+        // double hashing; user-supplied hashes aren't necessarily well-mixed
+        uint32_t h1 = HashUtil::hashint_full_avalanche_1(hash);
+        uint32_t h2 = HashUtil::hashint_full_avalanche_2(hash) | 1;
+        for (uint32_t i = 0; i < kNumProbes; ++i) {
+            uint32_t bit = (h1 + i * h2) & mask_;
+            bits_[bit >> 6] |= (1ULL << (bit & 63));
+        }
+    }
+
+    bool BloomFilter::MayContain(uint32_t hash) const {
+        if (bits_.empty())
+            return false;
+        uint32_t h1 = HashUtil::hashint_full_avalanche_1(hash);
+        uint32_t h2 = HashUtil::hashint_full_avalanche_2(hash) | 1;
+        for (uint32_t i = 0; i < kNumProbes; ++i) {
+            uint32_t bit = (h1 + i * h2) & mask_;
+            if (!(bits_[bit >> 6] & (1ULL << (bit & 63))))
+                return false;
+        }
+        return true;
+    }
+
+    void BloomFilter::Clear() {
+        bits_.clear();
+        mask_ = 0;
+    }
+
+    void BloomFilter::Free() {
+        std::vector<uint64_t>().swap(bits_);
+        mask_ = 0;
+    }
+}
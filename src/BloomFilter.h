@@ -0,0 +1,53 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef SRC_BLOOMFILTER_H_
+#define SRC_BLOOMFILTER_H_
+#include <stdint.h>
+#include <vector>
+
+namespace gpucbt {
+    /* Bloom filter over 32-bit hash values, sized at build time for the
+     * number of hashes it will hold. With at least kBitsPerElement bits per
+     * hash and kNumProbes probes, false positives are below ~2.5%. */
+    class BloomFilter {
+      public:
+        BloomFilter();
+        ~BloomFilter();
+        /* Size the filter for num hashes and clear it */
+        void Reset(uint32_t num);
+        void Add(uint32_t hash);
+        bool MayContain(uint32_t hash) const;
+        /* Drop all hashes, keeping the memory for the next Reset() */
+        void Clear();
+        /* Drop all hashes and release the memory */
+        void Free();
+
+      private:
+        static const uint32_t kBitsPerElement = 8;
+        static const uint32_t kNumProbes = 4;
+
+        std::vector<uint64_t> bits_;
+        // number of bits - 1; the number of bits is a power of 2
+        uint32_t mask_;
+    };
+}
+
+#endif  // SRC_BLOOMFILTER_H_
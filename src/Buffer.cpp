@@ -21,10 +21,14 @@
 // ---
 // Author: Hrishikesh Amur
 
+#define __STDC_LIMIT_MACROS /* for UINT32_MAX etc. */
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <algorithm>
+#include <queue>
 #include <sstream>
 #include "Buffer.h"
 #include "snappy.h"
@@ -34,11 +38,21 @@ namespace gpucbt {
 
     const uint32_t Buffer::kMaximumElements = 10000000;
     const uint32_t Buffer::kEmptyThreshold = 5000000;
+    const uint32_t Buffer::kInsertRunLength = 65536;
+    std::vector<Message*> Buffer::pool_;
+    uint32_t Buffer::poolLimit_ = 0;
+    pthread_mutex_t Buffer::poolMutex_ = PTHREAD_MUTEX_INITIALIZER;
+    std::map<Message*, uint32_t> Buffer::pinCounts_;
 
     Buffer::Buffer() :
             messages_(NULL),
-            num_elements_(0) {
-        messages_ = new Message[kMaximumElements];
+            num_elements_(0),
+            pinned_(0),
+            sorted_(false),
+            summarized_(false),
+            minHash_(0),
+            maxHash_(0) {
+        messages_ = NewArray();
     }
 
     Buffer::~Buffer() {
@@ -62,20 +76,155 @@ namespace gpucbt {
     }
 
     void Buffer::SetEmpty() {
+        // the array is kept for reuse unless readers still need it
+        DropPinned();
         set_num_elements(0);
+        runs_.clear();
+        sorted_ = false;
+        summarized_ = false;
+        filter_.Clear();
     }
 
     void Buffer::Clear() {
         messages_ = NULL;
+        pinned_ = 0;
         set_num_elements(0);
+        runs_.clear();
+        sorted_ = false;
+        summarized_ = false;
+        filter_.Clear();
+    }
+
+    void Buffer::Allocate(bool isLarge) {
+        // all buffers currently have the same capacity
+        if (!messages_)
+            messages_ = NewArray();
+    }
+
+    void Buffer::Append(const Message* msgs, uint32_t num) {
+        PrepareWrite(num_elements_);
+        std::copy(msgs, msgs + num, &messages_[num_elements_]);
+        set_num_elements(num_elements_ + num);
+        sorted_ = false;
+        summarized_ = false;
+    }
+
+    void Buffer::AppendRun(const Message* msgs, uint32_t num) {
+        uint32_t start = num_elements_;
+        bool runs = (sorted_ || (!runs_.empty() && runs_.back() == start));
+        Append(msgs, num);
+        if (start == 0) {
+            sorted_ = true;
+        } else if (runs) {
+            if (runs_.empty())
+                runs_.push_back(start);
+            runs_.push_back(start + num);
+        }
     }
 
     void Buffer::Deallocate() {
+        DropPinned();
         if (messages_) {
-            delete[] messages_;
+            FreeArray(messages_);
             messages_ = NULL;
         }
         set_num_elements(0);
+        runs_.clear();
+        sorted_ = false;
+        summarized_ = false;
+        filter_.Free();
+    }
+
+    Message* Buffer::NewArray() {
+        Message* messages = NULL;
+        pthread_mutex_lock(&poolMutex_);
+        if (!pool_.empty()) {
+            messages = pool_.back();
+            pool_.pop_back();
+        }
+        pthread_mutex_unlock(&poolMutex_);
+        if (!messages)
+            messages = new Message[kMaximumElements];
+        return messages;
+    }
+
+    void Buffer::FreeArray(Message* messages) {
+        pthread_mutex_lock(&poolMutex_);
+        if (pool_.size() < poolLimit_) {
+            pool_.push_back(messages);
+            messages = NULL;
+        }
+        pthread_mutex_unlock(&poolMutex_);
+        delete[] messages;
+    }
+
+    void Buffer::ReservePooled(uint32_t num) {
+        pthread_mutex_lock(&poolMutex_);
+        poolLimit_ += num;
+        pthread_mutex_unlock(&poolMutex_);
+    }
+
+    void Buffer::ReleasePooled(uint32_t num) {
+        std::vector<Message*> unused;
+        pthread_mutex_lock(&poolMutex_);
+        poolLimit_ -= num;
+        while (pool_.size() > poolLimit_) {
+            unused.push_back(pool_.back());
+            pool_.pop_back();
+        }
+        pthread_mutex_unlock(&poolMutex_);
+        for (uint32_t i = 0; i < unused.size(); ++i)
+            delete[] unused[i];
+    }
+
+    Message* Buffer::Pin(uint32_t num) {
+        pthread_mutex_lock(&poolMutex_);
+        if (pinned_ == 0)
+            pinCounts_[messages_] = 1;
+        pinCounts_[messages_]++;
+        pthread_mutex_unlock(&poolMutex_);
+        if (num > pinned_)
+            pinned_ = num;
+        return messages_;
+    }
+
+    void Buffer::Unpin(Message* messages) {
+        pthread_mutex_lock(&poolMutex_);
+        std::map<Message*, uint32_t>::iterator it = pinCounts_.find(messages);
+        bool last = (--it->second == 0);
+        if (last)
+            pinCounts_.erase(it);
+        pthread_mutex_unlock(&poolMutex_);
+        if (last)
+            FreeArray(messages);
+    }
+
+    void Buffer::PrepareWrite(uint32_t from) {
+        Allocate();
+        if (from >= pinned_)
+            return;
+        // no copy is needed if the readers are done with the array
+        pthread_mutex_lock(&poolMutex_);
+        std::map<Message*, uint32_t>::iterator it = pinCounts_.find(messages_);
+        bool shared = (it->second > 1);
+        if (!shared)
+            pinCounts_.erase(it);
+        pthread_mutex_unlock(&poolMutex_);
+        if (shared) {
+            Message* messages = NewArray();
+            std::copy(messages_, messages_ + num_elements_, messages);
+            Unpin(messages_);
+            messages_ = messages;
+        }
+        pinned_ = 0;
+    }
+
+    void Buffer::DropPinned() {
+        if (pinned_ == 0)
+            return;
+        Unpin(messages_);
+        messages_ = NULL;
+        pinned_ = 0;
     }
 
     void Buffer::Quicksort(uint32_t uleft, uint32_t uright) {
@@ -160,19 +309,172 @@ namespace gpucbt {
 
     // Sorting-related
     bool Buffer::Sort(bool use_gpu) {
-        if (empty())
+        // e.g. a leaf that has received a single sorted piece
+        if (empty() || sorted_)
             return true;
 
+        // runs generated at insertion time only need to be merged
+        if (!runs_.empty()) {
+            GenerateRuns(/*all = */true);
+            MergeRuns();
+            sorted_ = true;
+            return true;
+        }
+
         uint32_t num = num_elements();
+        PrepareWrite(0);
         // sort elements
         if (use_gpu) {
             GPUSort(num);
         } else {
             Quicksort(0, num - 1);
         }
+        sorted_ = true;
         return true;
     }
 
+    void Buffer::GenerateRuns(bool all) {
+        uint32_t start = (runs_.empty()? 0 : runs_.back());
+        uint32_t num = num_elements();
+        if (num - start >= kInsertRunLength || (all && num > start))
+            PrepareWrite(start);
+        while (num - start >= kInsertRunLength) {
+            Quicksort(start, start + kInsertRunLength - 1);
+            start += kInsertRunLength;
+            runs_.push_back(start);
+        }
+        if (all && num > start) {
+            Quicksort(start, num - 1);
+            runs_.push_back(num);
+        }
+    }
+
+    namespace {
+        // head of a run during a k-way merge
+        struct RunHead {
+            uint32_t hash;
+            uint32_t run;
+        };
+        struct RunHeadCompare {
+            bool operator()(const RunHead& lhs, const RunHead& rhs) const {
+                return (lhs.hash > rhs.hash);
+            }
+        };
+    }
+
+    void Buffer::MergeRuns() {
+        uint32_t num_runs = runs_.size();
+        if (num_runs > 1) {
+            Buffer aux;
+            std::vector<uint32_t> cur(num_runs);
+            std::priority_queue<RunHead, std::vector<RunHead>,
+                    RunHeadCompare> heads;
+            for (uint32_t i = 0; i < num_runs; ++i) {
+                cur[i] = (i == 0? 0 : runs_[i - 1]);
+                if (cur[i] < runs_[i]) {
+                    RunHead h = {messages_[cur[i]].hash(), i};
+                    heads.push(h);
+                }
+            }
+            uint32_t out = 0;
+            while (!heads.empty()) {
+                RunHead h = heads.top();
+                heads.pop();
+                aux.messages_[out++] = messages_[cur[h.run]];
+                if (++cur[h.run] < runs_[h.run]) {
+                    h.hash = messages_[cur[h.run]].hash();
+                    heads.push(h);
+                }
+            }
+            Deallocate();
+            messages_ = aux.messages_;
+            set_num_elements(out);
+            // Clear aux to prevent deallocation on destruction
+            aux.Clear();
+        }
+        runs_.clear();
+    }
+
+    namespace {
+        struct HashLess {
+            bool operator()(const Message& m, uint32_t hash) const {
+                return (m.hash() < hash);
+            }
+        };
+    }
+
+    void Buffer::Lookup(const Message& msg, Message& result,
+            bool& found) const {
+        if (!MayContain(msg.hash()))
+            return;
+        uint32_t num = num_elements();
+        if (sorted_) {
+            LookupSorted(msg, 0, num, result, found);
+            return;
+        }
+        // runs generated at insertion time, followed by an unsorted tail
+        uint32_t start = 0;
+        for (uint32_t i = 0; i < runs_.size(); ++i) {
+            LookupSorted(msg, start, runs_[i], result, found);
+            start = runs_[i];
+        }
+        for (uint32_t i = start; i < num; ++i) {
+            if (messages_[i].hash() == msg.hash() &&
+                    messages_[i].SameKey(msg)) {
+                if (found) {
+                    result.Merge(messages_[i]);
+                } else {
+                    result = messages_[i];
+                    found = true;
+                }
+            }
+        }
+    }
+
+    void Buffer::LookupSorted(const Message& msg, uint32_t left,
+            uint32_t right, Message& result, bool& found) const {
+        Message* m = std::lower_bound(messages_ + left, messages_ + right,
+                msg.hash(), HashLess());
+        for (; m < messages_ + right && m->hash() == msg.hash(); ++m) {
+            if (!m->SameKey(msg))
+                continue;
+            if (found) {
+                result.Merge(*m);
+            } else {
+                result = *m;
+                found = true;
+            }
+        }
+    }
+
+    void Buffer::Summarize() {
+        uint32_t num = num_elements();
+        if (num == 0)
+            return;
+        minHash_ = UINT32_MAX;
+        maxHash_ = 0;
+        filter_.Reset(num);
+        for (uint32_t i = 0; i < num; ++i) {
+            uint32_t h = messages_[i].hash();
+            if (h < minHash_)
+                minHash_ = h;
+            if (h > maxHash_)
+                maxHash_ = h;
+            filter_.Add(h);
+        }
+        summarized_ = true;
+    }
+
+    bool Buffer::MayContain(uint32_t hash) const {
+        if (empty())
+            return false;
+        if (!summarized_)
+            return true;
+        if (hash < minHash_ || hash > maxHash_)
+            return false;
+        return filter_.MayContain(hash);
+    }
+
     bool Buffer::Aggregate(bool use_gpu) {
         bool ret;
         if (use_gpu) {
@@ -184,41 +486,48 @@ namespace gpucbt {
     }
 
     bool Buffer::CPUAggregate() {
+        // emptied buffers may be deallocated
+        if (empty())
+            return true;
+
         // initialize auxiliary buffer
         Buffer aux;
 
-        // aggregate elements in buffer
-        uint32_t lastIndex = 0;
+        // aggregate elements into aux; the buffer itself is left untouched
+        // as it may be pinned
+        Message* agg = aux.messages_;
         uint32_t aggregatedIndex = 0;
         uint32_t num = num_elements();
+        agg[0] = messages_[0];
         for (uint32_t i = 1; i < num; ++i) {
             if (messages_[i].hash() ==
-                    messages_[lastIndex].hash()) {
+                    agg[aggregatedIndex].hash()) {
                 // aggregate elements
                 if (messages_[i].SameKey(
-                            messages_[lastIndex])) {
-                    messages_[lastIndex].Merge(messages_[i]);
+                            agg[aggregatedIndex])) {
+                    agg[aggregatedIndex].Merge(messages_[i]);
                     continue;
                 }
             }
 
             // we found a Message with a different key than that in
-            // messages_[lastIndex]. Therefore we store the latter and update
-            // lastIndex
-            aux.messages_[aggregatedIndex] = messages_[lastIndex];
-            ++aggregatedIndex;
-            lastIndex = i;
-        }
-        // copy the last Message;
-        aux.messages_[aggregatedIndex] = messages_[lastIndex];
+            // agg[aggregatedIndex]. Therefore we start a new aggregate
+            agg[++aggregatedIndex] = messages_[i];
+        }
         aggregatedIndex++;
 
+        // aggregation keeps the buffer sorted
+        bool sorted = sorted_;
         Deallocate();
         messages_ = aux.messages_;
         set_num_elements(aggregatedIndex);
+        sorted_ = sorted;
 
         // Clear aux to prevent deallocation on destruction
         aux.Clear();
+
+        // merged buffers are probed by lookups until they are emptied
+        Summarize();
         return true;
     }
 }
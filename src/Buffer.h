@@ -23,8 +23,12 @@
 
 #ifndef SRC_BUFFER_H_
 #define SRC_BUFFER_H_
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <map>
+#include <vector>
+#include "BloomFilter.h"
 #include "Config.h"
 #include "Message.h"
 
@@ -49,6 +53,12 @@ namespace gpucbt {
           void SetEmpty();
 
           void Allocate(bool isLarge = false);
+          // Appends num messages, allocating the buffer if necessary
+          void Append(const Message* msgs, uint32_t num);
+          /* Appends num messages sorted by hash. They are recorded as
+           * another sorted run if the buffer is sorted or made up of runs,
+           * so that it can later be merged rather than sorted */
+          void AppendRun(const Message* msgs, uint32_t num);
           // DOES NOT FREE memory. Only resets Buffer
           void Clear();
           // Frees memory buffer and resets Buffer
@@ -58,20 +68,84 @@ namespace gpucbt {
           void Quicksort(uint32_t left, uint32_t right);
           void GPUSort(uint32_t num);
           bool Sort(bool use_gpu = false);
+          /* Sort every complete run of kInsertRunLength messages that has
+           * been appended since the last call and record its end. If all is
+           * set, the remaining partial run is sorted as well */
+          void GenerateRuns(bool all = false);
+          /* k-way merge of the runs recorded by GenerateRuns() */
+          void MergeRuns();
+
+          /* Lookup-related */
+          /* Combine every message with msg's key into result; found is set
+           * once result holds something. Sorted buffers and sorted runs are
+           * binary searched, anything else is scanned */
+          void Lookup(const Message& msg, Message& result, bool& found) const;
+
+          /* Build the hash fences and Bloom filter that let lookups skip
+           * the buffer. They stay valid until the buffer is modified */
+          void Summarize();
+          /* false if the buffer certainly holds no message with hash */
+          bool MayContain(uint32_t hash) const;
 
           /* Aggregation-related */
           bool Aggregate(bool use_gpu = false);
           bool CPUAggregate();
           bool GPUAggregate();
 
+          /* Snapshot-related */
+          /* Share the first num messages with a reader. They stay as they
+           * are, and the array isn't freed, until Unpin() is called on the
+           * returned array; the buffer works on a copy if it has to modify
+           * them in the meantime */
+          Message* Pin(uint32_t num);
+          static void Unpin(Message* messages);
+
         private:
           static const uint32_t kMaximumElements;
           static const uint32_t kEmptyThreshold;
+          static const uint32_t kInsertRunLength;
+          /* Message arrays of deallocated buffers are kept for reuse, so
+           * that their pages stay mapped, but only as many as recycled
+           * trees have reserved for their input and root buffers */
+          static std::vector<Message*> pool_;
+          static uint32_t poolLimit_;
+          static pthread_mutex_t poolMutex_;
+          static Message* NewArray();
+          static void FreeArray(Message* messages);
+          /* Let the pool hold num more arrays, or num fewer, in which case
+           * the arrays over the limit are freed */
+          static void ReservePooled(uint32_t num);
+          static void ReleasePooled(uint32_t num);
+          /* References held on pinned arrays, including that of the buffer
+           * the array belongs to. poolMutex_ protected */
+          static std::map<Message*, uint32_t> pinCounts_;
+
+          /* Called before messages from index from on are written:
+           * allocates the array if necessary and copies it if the messages
+           * are pinned */
+          void PrepareWrite(uint32_t from);
+          /* Leave a pinned array to its readers */
+          void DropPinned();
 
           const Node* node_;
 
           Message* messages_;
           uint32_t num_elements_;
+          // number of leading messages pinned by readers; 0 if none are
+          uint32_t pinned_;
+          // Sorted runs generated at insertion time: each entry is the end
+          // offset of a run; the first run starts at 0
+          std::vector<uint32_t> runs_;
+          // set when the whole buffer is known to be sorted by hash
+          bool sorted_;
+          // set while minHash_, maxHash_ and filter_ describe the buffer
+          bool summarized_;
+          uint32_t minHash_;
+          uint32_t maxHash_;
+          BloomFilter filter_;
+
+          void LookupSorted(const Message& msg, uint32_t left,
+                  uint32_t right, Message& result, bool& found) const;
     };
 }
 #endif  // SRC_BUFFER_H_
@@ -22,67 +22,1199 @@
 // Author: Hrishikesh Amur
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #define __STDC_LIMIT_MACROS /* for UINT32_MAX etc. */
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
 #include <deque>
+#include <string>
 
 #include "Buffer.h"
 #include "CompressTree.h"
+#include "HashAggregator.h"
+#include "HotKeyCache.h"
+#include "HyperLogLog.h"
+#include "RunFile.h"
 #include "Slaves.h"
+#include "HashUtil.h"
 
 namespace gpucbt {
-    CompressTree::CompressTree(uint32_t b, uint32_t buffer_size) :
+    const uint32_t CompressTree::kMaxStagedMessages = 1048576;
+    const uint32_t CompressTree::kPresplitSampleSize = 65536;
+    const uint32_t CompressTree::kMergeSpanSize = 65536;
+    const uint64_t CompressTree::kNumHashes = 1ULL << 32;
+    const uint32_t CompressTree::kCheckpointMagic = 0x54504b43;  // "CKPT"
+    const uint32_t CompressTree::kCheckpointVersion = 3;
+#ifdef ENABLE_HASH_AGGREGATION
+    const uint32_t CompressTree::kHashAggregationLimit = 1048576;
+    const uint32_t CompressTree::kCardinalityCheckInterval = 65536;
+#endif
+
+    CompressTree::CompressTree(uint32_t b, uint32_t buffer_size,
+            EmptyMethod method, FinalizeMethod finalize) :
             b_(b),
+            emptyMethod_(method),
+            finalizeMethod_(finalize),
             nodeCtr(1),
+            flushNode_(NULL),
+            flushReachedRoot_(false),
+            pendingActions_(0),
+            staged_(NULL),
+            numStaged_(0),
+            numWouldBlock_(0),
             allFlush_(true),
-            lastLeafRead_(0),
+            numHeavyLeaves_(0),
+            numLeaves_(0),
+            readLeaf_(NULL),
             lastOffset_(0),
             lastElement_(0),
-            threadsStarted_(false) {
+            pinnedSpans_(0),
+            readFinished_(false),
+            recycle_(false),
+            keepSkeleton_(false),
+            pooledArrays_(0),
+            epoch_(0),
+            presplitLeaves_(0),
+            presplitPending_(false),
+            maxMemoryLeaves_(0),
+            threadsStarted_(false),
+            pinThreads_(false) {
+        CPU_ZERO(&affinity_);
         pthread_cond_init(&emptyRootAvailable_, NULL);
         pthread_mutex_init(&emptyRootNodesMutex_, NULL);
+        pthread_mutex_init(&inputMutex_, NULL);
+        // splits are short; don't let a steady stream of slaves and lookups
+        // starve them
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr,
+                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&treeLock_, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        pthread_cond_init(&flushProgress_, NULL);
+        pthread_mutex_init(&flushProgressMutex_, NULL);
+        pthread_cond_init(&actionsDone_, NULL);
+        pthread_mutex_init(&pendingActionsMutex_, NULL);
+        memset(stallHistogram_, 0, sizeof(stallHistogram_));
+#ifdef ENABLE_HASH_AGGREGATION
+        hashMode_ = true;
+        hashAgg_ = new HashAggregator(kHashAggregationLimit);
+        cardinality_ = new HyperLogLog();
+        numHashAggregated_ = 0;
+#endif
+#ifdef ENABLE_HOTKEY_CACHE
+        hotKeys_ = new HotKeyCache();
+#endif
     }
 
     CompressTree::~CompressTree() {
+        // a recycled tree keeps its threads until it goes away
+        if (threadsStarted_) {
+            EmptyTree();
+            StopThreads();
+        }
         pthread_cond_destroy(&emptyRootAvailable_);
         pthread_mutex_destroy(&emptyRootNodesMutex_);
+        pthread_mutex_destroy(&inputMutex_);
+        pthread_rwlock_destroy(&treeLock_);
+        pthread_cond_destroy(&flushProgress_);
+        pthread_mutex_destroy(&flushProgressMutex_);
+        pthread_cond_destroy(&actionsDone_);
+        pthread_mutex_destroy(&pendingActionsMutex_);
         pthread_barrier_destroy(&threadsBarrier_);
+        delete[] staged_;
+#ifdef ENABLE_HASH_AGGREGATION
+        delete hashAgg_;
+        delete cardinality_;
+#endif
+#ifdef ENABLE_HOTKEY_CACHE
+        delete hotKeys_;
+#endif
     }
 
     bool CompressTree::bulk_insert(const Message* msgs, uint64_t num) {
-        bool ret = true;
         // copy buf into root node buffer
         // root node buffer always decompressed
         if (num > 0)
             allFlush_ = false;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_) {
+            uint64_t n = HashAggregate(msgs, num, /*block = */true);
+            if (n == num)
+                return true;
+            msgs += n;
+            num -= n;
+        }
+#endif  // ENABLE_HASH_AGGREGATION
         if (!threadsStarted_) {
             StartThreads();
         }
-        for (uint64_t i = 0; i < num; ++i) {
-            if (inputNode_->isFull()) {
-                // add inputNode_ to be sorted
-                inputNode_->schedule(SORT);
+        if (numStaged_ > 0)
+            DrainStaged(/*block = */true);
+        return (InsertIntoInputNode(msgs, num, /*block = */true) == num);
+    }
 
-                // get an empty root. This function can block until there are
-                // empty roots available
-                inputNode_ = GetEmptyRootNode();
-#ifdef CT_NODE_DEBUG
-                fprintf(stderr, "Now inputting into node %d\n",
-                        inputNode_->id());
-#endif  // CT_NODE_DEBUG
-            }
-            ret &= inputNode_->insert(msgs[i]);
+    bool CompressTree::try_bulk_insert(const Message* msgs, uint64_t num,
+            uint64_t& num_inserted) {
+        if (num > 0)
+            allFlush_ = false;
+        num_inserted = 0;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_) {
+            num_inserted = HashAggregate(msgs, num, /*block = */false);
+            if (num_inserted == num)
+                return true;
         }
-        return ret;
+#endif  // ENABLE_HASH_AGGREGATION
+        if (!threadsStarted_) {
+            StartThreads();
+        }
+        if (numStaged_ == 0 || DrainStaged(/*block = */false)) {
+            num_inserted += InsertIntoInputNode(msgs + num_inserted,
+                    num - num_inserted, /*block = */false);
+        }
+
+        // stage whatever could not be inserted
+        if (num_inserted < num) {
+            pthread_mutex_lock(&inputMutex_);
+            num_inserted += Stage(msgs + num_inserted, num - num_inserted);
+            pthread_mutex_unlock(&inputMutex_);
+        }
+        if (num_inserted < num) {
+            pthread_mutex_lock(&emptyRootNodesMutex_);
+            numWouldBlock_++;
+            pthread_mutex_unlock(&emptyRootNodesMutex_);
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t CompressTree::InsertIntoInputNode(const Message* msgs,
+            uint64_t num, bool block) {
+        uint64_t rem = num;
+        while (rem > 0) {
+            if (inputNode_->isFull() && !SwapInputNode(block))
+                break;
+            // copy as many messages as fit before the input node is full
+            pthread_mutex_lock(&inputMutex_);
+            uint32_t space = Buffer::kEmptyThreshold + 1 -
+                    inputNode_->buffer_.num_elements();
+            uint32_t n = (rem < space? rem : space);
+            FillInputNode(msgs + (num - rem), n);
+            pthread_mutex_unlock(&inputMutex_);
+            rem -= n;
+        }
+        return num - rem;
+    }
+
+    void CompressTree::FillInputNode(const Message* msgs, uint32_t num) {
+#ifdef ENABLE_HOTKEY_CACHE
+        // every message goes through the cache; only evicted messages
+        // take up space in the input buffer, at most one per message
+        Message evicted;
+        for (uint32_t i = 0; i < num; ++i) {
+            if (hotKeys_->Insert(msgs[i], evicted))
+                inputNode_->insert(evicted);
+        }
+#else
+        inputNode_->insert(msgs, num);
+#endif  // ENABLE_HOTKEY_CACHE
+    }
+
+    uint64_t CompressTree::Stage(const Message* msgs, uint64_t num) {
+        if (!staged_)
+            staged_ = new Message[kMaxStagedMessages];
+        uint32_t space = kMaxStagedMessages - numStaged_;
+        uint32_t n = (num < space? num : space);
+        std::copy(msgs, msgs + n, &staged_[numStaged_]);
+        numStaged_ += n;
+        return n;
+    }
+
+    bool CompressTree::DrainStaged(bool block) {
+        while (numStaged_ > 0) {
+            if (inputNode_->isFull() && !SwapInputNode(block))
+                break;
+            // messages are taken off the end, so that the rest stays in
+            // place, and leave the staging area as they enter the input node
+            pthread_mutex_lock(&inputMutex_);
+            uint32_t space = Buffer::kEmptyThreshold + 1 -
+                    inputNode_->buffer_.num_elements();
+            uint32_t n = (numStaged_ < space? numStaged_ : space);
+            FillInputNode(&staged_[numStaged_ - n], n);
+            numStaged_ -= n;
+            pthread_mutex_unlock(&inputMutex_);
+        }
+        return (numStaged_ == 0);
     }
 
     bool CompressTree::insert(const Message& msg) {
-        bool ret = bulk_insert(&msg, 1);
+        allFlush_ = false;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_ && HashAggregate(&msg, 1, /*block = */true) == 1)
+            return true;
+#endif  // ENABLE_HASH_AGGREGATION
+        if (!threadsStarted_) {
+            StartThreads();
+        }
+        if (inputNode_->isFull())
+            SwapInputNode();
+        pthread_mutex_lock(&inputMutex_);
+        FillInputNode(&msg, 1);
+        pthread_mutex_unlock(&inputMutex_);
+        return true;
+    }
+
+    Message* CompressTree::AllocateBatch() {
+        return Buffer::NewArray();
+    }
+
+    void CompressTree::FreeBatch(Message* batch) {
+        Buffer::FreeArray(batch);
+    }
+
+    uint32_t CompressTree::MaxBatchSize() {
+        return Buffer::kEmptyThreshold;
+    }
+
+    bool CompressTree::bulk_insert_owned(Message* batch, uint32_t num) {
+        bool ret = true;
+        bool copy = (num > MaxBatchSize());
+#ifdef ENABLE_HASH_AGGREGATION
+        copy |= hashMode_;
+#endif
+        if (copy) {
+            ret = bulk_insert(batch, num);
+            Buffer::FreeArray(batch);
+            return ret;
+        }
+        if (num > 0)
+            allFlush_ = false;
+        if (!threadsStarted_) {
+            StartThreads();
+        }
+        if (inputNode_->isFull())
+            SwapInputNode();
+
+        // Either the batch or the partially filled input buffer has to be
+        // copied; copy whichever is smaller. Order within the input buffer is
+        // irrelevant since it is sorted before emptying. Adopted batches
+        // bypass the hot-key cache.
+        Buffer& in = inputNode_->buffer_;
+        uint32_t cur = in.num_elements();
+        if (cur > num) {
+            ret = bulk_insert(batch, num);
+            Buffer::FreeArray(batch);
+        } else {
+            pthread_mutex_lock(&inputMutex_);
+            std::copy(in.messages_, in.messages_ + cur, &batch[num]);
+            in.Deallocate();
+            in.messages_ = batch;
+            in.set_num_elements(num + cur);
+            pthread_mutex_unlock(&inputMutex_);
+        }
         return ret;
     }
 
+    bool CompressTree::bulk_load_sorted(const Message* msgs, uint64_t num) {
+        if (threadsStarted_)
+            return false;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashAgg_->size() > 0)
+            return false;
+#endif
+        for (uint64_t i = 1; i < num; ++i) {
+            if (msgs[i].hash() < msgs[i - 1].hash())
+                return false;
+        }
+        if (num == 0)
+            return true;
+
+        // fill target of each leaf, as after a leaf split
+        uint32_t target = Buffer::kEmptyThreshold / 2;
+        std::vector<Node*> leaves;
+        Node* leaf = NULL;
+        Message* out = NULL;
+        uint32_t n = 0;
+        // where the current hash starts in out
+        uint32_t hashStart = 0;
+        bool ok = true;
+        for (uint64_t i = 0; i < num && ok; ++i) {
+            if (i > 0 && msgs[i].hash() == msgs[i - 1].hash()) {
+                // aggregate adjacent duplicates
+                if (n > 0 && out[n - 1].SameKey(msgs[i])) {
+                    out[n - 1].Merge(msgs[i]);
+                    continue;
+                }
+            } else {
+                if (leaf && (n >= target || !leaf->runFiles_.empty())) {
+                    // full enough; close the leaf at a hash boundary
+                    leaf->separator_ = msgs[i].hash();
+                    leaf->buffer_.set_num_elements(n);
+                    leaf = NULL;
+                }
+                hashStart = n;
+            }
+            if (!leaf) {
+                leaf = new Node(this, 0);
+                leaf->buffer_.Allocate();
+                leaves.push_back(leaf);
+                out = leaf->buffer_.messages_;
+                n = 0;
+                hashStart = 0;
+            } else if (hashStart > 0 && n - hashStart >= target) {
+                // msgs[i] makes this a heavy-key run; cut it out into a leaf
+                // of its own, as SplitLeaf() does
+                leaf->separator_ = msgs[i].hash();
+                leaf->buffer_.set_num_elements(hashStart);
+                Node* next = new Node(this, 0);
+                next->buffer_.Allocate();
+                leaves.push_back(next);
+                n -= hashStart;
+                std::copy(&out[hashStart], &out[hashStart] + n,
+                        next->buffer_.messages_);
+                leaf = next;
+                out = leaf->buffer_.messages_;
+                hashStart = 0;
+            } else if (n == Buffer::kEmptyThreshold) {
+                // only a heavy-key leaf gets this full; its buffer is chained
+                // on as a run, as for a full heavy-key leaf in the tree
+                leaf->buffer_.set_num_elements(n);
+                ok = leaf->WriteRun();
+                leaf->buffer_.Allocate();
+                out = leaf->buffer_.messages_;
+                n = 0;
+            }
+            out[n++] = msgs[i];
+        }
+        leaf->separator_ = UINT32_MAX;
+        leaf->buffer_.set_num_elements(n);
+
+        // only leaves with a single hash that doesn't fit in half a buffer
+        // are heavy, as in SplitLeaf()
+        for (uint32_t i = 0; ok && i < leaves.size(); ++i) {
+            Buffer& b = leaves[i]->buffer_;
+            uint32_t k = b.num_elements();
+            if (leaves[i]->runFiles_.empty() && (k <= target ||
+                    b.messages_[0].hash() != b.messages_[k - 1].hash()))
+                continue;
+            if (k > target) {
+                // leave as much room for what the parent empties into it as
+                // in the other leaves
+                ok = leaves[i]->WriteRun();
+                b.Allocate();
+            }
+            leaves[i]->heavy_ = true;
+        }
+        if (!ok) {
+            for (uint32_t i = 0; i < leaves.size(); ++i) {
+                leaves[i]->buffer_.Deallocate();
+                delete leaves[i];
+            }
+            return false;
+        }
+        for (uint32_t i = 0; i < leaves.size(); ++i) {
+            leaves[i]->buffer_.sorted_ = true;
+            leaves[i]->buffer_.Summarize();
+            if (leaves[i]->heavy_)
+                numHeavyLeaves_++;
+        }
+
+        // the tree is built by hand; no skeleton
+        uint32_t presplitLeaves = presplitLeaves_;
+        presplitLeaves_ = 0;
+        StartThreads();
+        presplitLeaves_ = presplitLeaves;
+#ifdef ENABLE_HASH_AGGREGATION
+        hashMode_ = false;
+#endif
+
+        fprintf(stderr, "Bulk-loaded %lu messages into %lu leaves\n", num,
+                leaves.size());
+        // the root is never a leaf holding data: its buffer is swapped with
+        // input buffers
+        pthread_rwlock_wrlock(&treeLock_);
+        numLeaves_ = leaves.size();
+        BuildUpperLevels(leaves);
+        pthread_rwlock_unlock(&treeLock_);
+        allFlush_ = false;
+        return true;
+    }
+
+    namespace {
+        struct HashLess {
+            bool operator()(const Message& m, uint32_t hash) const {
+                return (m.hash() < hash);
+            }
+        };
+    }
+
+    bool CompressTree::MergeSorted(const Message* msgs, uint64_t num) {
+        for (uint64_t i = 1; i < num; ++i) {
+            if (msgs[i].hash() < msgs[i - 1].hash())
+                return false;
+        }
+        if (num == 0)
+            return true;
+        if (!threadsStarted_ && bulk_load_sorted(msgs, num))
+            return true;
+        allFlush_ = false;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_)
+            SwitchToTreeMode(/*block = */true);
+#endif
+        if (!threadsStarted_) {
+            StartThreads();
+        }
+
+        // ranges of msgs left to be merged, as [first, second)
+        std::vector<std::pair<uint64_t, uint64_t> > todo, deferred;
+        todo.push_back(std::make_pair(0, num));
+        while (!todo.empty()) {
+            pthread_rwlock_wrlock(&treeLock_);
+            if (rootNode_->isLeaf()) {
+                // the root's buffer is swapped with input buffers, so the
+                // messages have to go through them
+                pthread_rwlock_unlock(&treeLock_);
+                for (uint32_t i = 0; i < todo.size(); ++i) {
+                    bulk_insert(msgs + todo[i].first,
+                            todo[i].second - todo[i].first);
+                }
+                return true;
+            }
+            for (uint32_t i = 0; i < todo.size(); ++i) {
+                uint64_t cur = todo[i].first;
+                uint64_t end = todo[i].second;
+                while (cur < end) {
+                    // find the leaf and the end of its range
+                    Node* leaf = rootNode_;
+                    uint32_t bound = UINT32_MAX;
+                    while (!leaf->isLeaf()) {
+                        leaf = leaf->children_[leaf->findChild(
+                                msgs[cur].hash())];
+                        bound = std::min(bound, leaf->separator_);
+                    }
+                    uint64_t last = end;
+                    if (bound != UINT32_MAX) {
+                        last = std::lower_bound(msgs + cur, msgs + end,
+                                bound, HashLess()) - msgs;
+                    }
+                    // Only a leaf whose parent is idle can be scheduled: the
+                    // emptier assumes that children don't become busy behind
+                    // a queued parent's back. Other leaves aren't filled up
+                    // either, as the parent could then overflow them.
+                    uint32_t n = 0;
+                    if (leaf->getQueueStatus() == NONE &&
+                            leaf->parent_->getQueueStatus() == NONE) {
+                        uint32_t cnt = leaf->buffer_.num_elements();
+                        if (cnt <= Buffer::kEmptyThreshold) {
+                            uint32_t space = Buffer::kEmptyThreshold + 1 - cnt;
+                            n = (last - cur < space? last - cur : space);
+                            leaf->buffer_.AppendRun(msgs + cur, n);
+                        }
+                        if (leaf->isFull())
+                            leaf->SpillBuffer();
+                    }
+                    if (cur + n < last)
+                        deferred.push_back(std::make_pair(cur + n, last));
+                    cur = last;
+                }
+            }
+            pthread_rwlock_unlock(&treeLock_);
+            todo.swap(deferred);
+            deferred.clear();
+            // let busy leaves finish and full ones be split
+            if (!todo.empty())
+                WaitForSlaves();
+        }
+        return true;
+    }
+
+    bool CompressTree::MergeFrom(CompressTree& other) {
+        if (&other == this)
+            return false;
+        uint64_t num = 0;
+        MessageSpan span;
+        while (other.ReadSpan(span)) {
+            MergeSorted(span.messages, span.num);
+            num += span.num;
+            other.ReleaseSpan();
+        }
+        fprintf(stderr, "Merged %lu aggregates from another tree\n", num);
+        return true;
+    }
+
+    bool CompressTree::Lookup(const Message& msg, Message& result) {
+        // Messages only move one way: from the hash table, the hot-key cache
+        // and the staging area into the input nodes, from those to the root
+        // and from parents to children, each time with the node they leave
+        // locked. Locking the root before the input side, and each child
+        // before letting go of its parent, finds every message exactly once
+        pthread_rwlock_rdlock(&treeLock_);
+        Node* n = LockInput();
+        bool found = false;
+#ifdef ENABLE_HASH_AGGREGATION
+        // everything is in the table until the tree takes over
+        if (hashMode_) {
+            found = hashAgg_->Lookup(msg, result);
+            pthread_mutex_unlock(&inputMutex_);
+            if (n)
+                pthread_mutex_unlock(&n->bufferMutex_);
+            pthread_rwlock_unlock(&treeLock_);
+            return found;
+        }
+#endif
+        Message m;
+#ifdef ENABLE_HOTKEY_CACHE
+        if (hotKeys_->Lookup(msg, m)) {
+            result = m;
+            found = true;
+        }
+#endif
+        for (uint32_t i = 0; i < numStaged_; ++i) {
+            m = staged_[i];
+            if (m.hash() != msg.hash() || !m.SameKey(msg))
+                continue;
+            if (found) {
+                result.Merge(m);
+            } else {
+                result = m;
+                found = true;
+            }
+        }
+        // input buffers that are being filled, sorted or waiting for the
+        // root; emptied ones are empty
+        for (uint32_t i = 0; n && i < inputNodes_.size(); ++i) {
+            Node* in = inputNodes_[i];
+            pthread_mutex_lock(&in->bufferMutex_);
+            in->buffer_.Lookup(msg, result, found);
+            pthread_mutex_unlock(&in->bufferMutex_);
+        }
+        pthread_mutex_unlock(&inputMutex_);
+
+        // buffers along the path to the covering leaf
+        while (n) {
+            n->buffer_.Lookup(msg, result, found);
+            Node* next = NULL;
+            if (n->isLeaf()) {
+                for (uint32_t i = 0; i < n->runFiles_.size(); ++i)
+                    n->runFiles_[i]->Lookup(msg, result, found);
+            } else {
+                next = n->children_[n->findChild(msg.hash())];
+                pthread_mutex_lock(&next->bufferMutex_);
+            }
+            pthread_mutex_unlock(&n->bufferMutex_);
+            n = next;
+        }
+        pthread_rwlock_unlock(&treeLock_);
+        return found;
+    }
+
+    uint64_t CompressTree::Scan(uint32_t lo, uint64_t hi,
+            ScanCallback callback, void* arg) {
+        if (hi > kNumHashes)
+            hi = kNumHashes;
+        if (lo >= hi)
+            return 0;
+        Snapshot* snap = SnapshotRange(lo, hi);
+        uint64_t numAggregates = 0;
+        Message msg;
+        while (snap->Next(msg)) {
+            callback(msg, arg);
+            numAggregates++;
+        }
+        delete snap;
+        return numAggregates;
+    }
+
+    Snapshot* CompressTree::TakeSnapshot() {
+        return SnapshotRange(0, kNumHashes);
+    }
+
+    Snapshot* CompressTree::SnapshotRange(uint32_t lo, uint64_t hi) {
+        Snapshot* snap = new Snapshot();
+        std::vector<Message>& msgs = snap->unsorted_;
+        std::vector<PinnedNode> inputs;
+        std::vector<PinnedNode> nodes;
+        PinAll(msgs, inputs, nodes, lo, hi);
+
+        std::vector<MessageSpan> unsorted;
+        for (uint32_t i = 0; i < inputs.size(); ++i)
+            AddToSnapshot(inputs[i], snap, unsorted, lo, hi);
+        for (uint32_t i = 0; i < nodes.size(); ++i)
+            AddToSnapshot(nodes[i], snap, unsorted, lo, hi);
+        // pinned messages don't change, so they can be copied unlocked;
+        // only these are sorted, everything else is merged where it is
+        for (uint32_t i = 0; i < unsorted.size(); ++i) {
+            const Message* m = unsorted[i].messages;
+            const Message* end = m + unsorted[i].num;
+            for (; m < end; ++m) {
+                if (m->hash() >= lo && m->hash() < hi)
+                    msgs.push_back(*m);
+            }
+        }
+        std::sort(msgs.begin(), msgs.end());
+        if (!msgs.empty())
+            snap->merge_.Add(&msgs[0], &msgs[0] + msgs.size());
+        return snap;
+    }
+
+    Node* CompressTree::LockInput() {
+        // threadsStarted_ is only set with inputMutex_ held, and the root
+        // only changes with treeLock_ held exclusively
+        Node* root = NULL;
+        pthread_mutex_lock(&inputMutex_);
+        while (threadsStarted_ && !root) {
+            pthread_mutex_unlock(&inputMutex_);
+            root = rootNode_;
+            pthread_mutex_lock(&root->bufferMutex_);
+            pthread_mutex_lock(&inputMutex_);
+        }
+        return root;
+    }
+
+    void CompressTree::PinAll(std::vector<Message>& pending,
+            std::vector<PinnedNode>& inputs,
+            std::vector<PinnedNode>& nodes, uint32_t lo, uint64_t hi) {
+        // the tree keeps its shape while the lock is held shared
+        pthread_rwlock_rdlock(&treeLock_);
+        Node* root = LockInput();
+        bool tree = (root != NULL);
+#ifdef ENABLE_HASH_AGGREGATION
+        // everything is in the table until the tree takes over
+        if (hashMode_) {
+            hashAgg_->CopyRange(lo, hi, pending);
+            tree = false;
+        }
+#endif
+#ifdef ENABLE_HOTKEY_CACHE
+        hotKeys_->CopyRange(lo, hi, pending);
+#endif
+        for (uint32_t i = 0; i < numStaged_; ++i) {
+            if (staged_[i].hash() >= lo && staged_[i].hash() < hi)
+                pending.push_back(staged_[i]);
+        }
+        for (uint32_t i = 0; tree && i < inputNodes_.size(); ++i) {
+            Node* in = inputNodes_[i];
+            inputs.push_back(PinnedNode());
+            pthread_mutex_lock(&in->bufferMutex_);
+            PinNode(in, UINT32_MAX, inputs.back());
+            pthread_mutex_unlock(&in->bufferMutex_);
+        }
+        // new messages only enter the input node from here on
+        pthread_mutex_unlock(&inputMutex_);
+        if (tree)
+            PinSubtree(root, UINT32_MAX, nodes, lo, hi);
+        else if (root)
+            pthread_mutex_unlock(&root->bufferMutex_);
+        pthread_rwlock_unlock(&treeLock_);
+    }
+
+    void CompressTree::PinSubtree(Node* n, uint32_t parent,
+            std::vector<PinnedNode>& nodes, uint32_t lo, uint64_t hi) {
+        uint32_t index = nodes.size();
+        nodes.push_back(PinnedNode());
+        PinNode(n, parent, nodes.back());
+        if (!n->isLeaf()) {
+            // children whose ranges overlap [lo, hi)
+            uint32_t last = n->findChild(hi - 1);
+            for (uint32_t i = n->findChild(lo); i <= last; ++i) {
+                Node* c = n->children_[i];
+                pthread_mutex_lock(&c->bufferMutex_);
+                PinSubtree(c, index, nodes, lo, hi);
+            }
+        }
+        pthread_mutex_unlock(&n->bufferMutex_);
+    }
+
+    void CompressTree::PinNode(Node* n, uint32_t parent,
+            PinnedNode& pinned) {
+        Buffer& buf = n->buffer_;
+        pinned.parent = parent;
+        pinned.level = n->level_;
+        pinned.separator = n->separator_;
+        pinned.heavy = n->heavy_;
+        pinned.messages = NULL;
+        pinned.num = buf.num_elements();
+        pinned.runs = buf.runs_;
+        pinned.sorted = buf.sorted_;
+        pinned.summarized = buf.summarized_;
+        if (!buf.sorted_ && !buf.runs_.empty()) {
+            // only pin the runs; the unsorted tail is short and it is
+            // sorted in place as the buffer fills up
+            pinned.num = buf.runs_.back();
+            pinned.tail.assign(buf.messages_ + pinned.num,
+                    buf.messages_ + buf.num_elements());
+        }
+        if (pinned.num > 0)
+            pinned.messages = buf.Pin(pinned.num);
+        // runs are immutable; holding a reference is enough
+        pinned.runFiles = n->runFiles_;
+        for (uint32_t i = 0; i < pinned.runFiles.size(); ++i)
+            pinned.runFiles[i]->Ref();
+    }
+
+    namespace {
+        /* Add the part of the sorted [begin, end) with hashes in [lo, hi)
+         * to merge */
+        void AddSortedRange(SegmentMerger& merge, const Message* begin,
+                const Message* end, uint32_t lo, uint64_t hi) {
+            begin = std::lower_bound(begin, end, lo, HashLess());
+            if (hi <= UINT32_MAX)
+                end = std::lower_bound(begin, end,
+                        static_cast<uint32_t>(hi), HashLess());
+            if (begin < end)
+                merge.Add(begin, end);
+        }
+    }
+
+    void CompressTree::AddToSnapshot(PinnedNode& pinned, Snapshot* snap,
+            std::vector<MessageSpan>& unsorted, uint32_t lo, uint64_t hi) {
+        for (uint32_t i = 0; i < pinned.tail.size(); ++i) {
+            const Message& m = pinned.tail[i];
+            if (m.hash() >= lo && m.hash() < hi)
+                snap->unsorted_.push_back(m);
+        }
+        for (uint32_t i = 0; i < pinned.runFiles.size(); ++i) {
+            RunFile* run = pinned.runFiles[i];
+            snap->runs_.push_back(run);
+            AddSortedRange(snap->merge_, run->begin(), run->end(), lo, hi);
+        }
+        Message* messages = pinned.messages;
+        if (!messages)
+            return;
+        snap->pinned_.push_back(messages);
+        if (pinned.sorted) {
+            AddSortedRange(snap->merge_, messages, messages + pinned.num,
+                    lo, hi);
+        } else if (!pinned.runs.empty()) {
+            uint32_t start = 0;
+            for (uint32_t i = 0; i < pinned.runs.size(); ++i) {
+                AddSortedRange(snap->merge_, messages + start,
+                        messages + pinned.runs[i], lo, hi);
+                start = pinned.runs[i];
+            }
+        } else {
+            MessageSpan span = {messages, pinned.num};
+            unsorted.push_back(span);
+        }
+    }
+
+    Snapshot::Snapshot() {
+    }
+
+    Snapshot::~Snapshot() {
+        for (uint32_t i = 0; i < pinned_.size(); ++i)
+            Buffer::Unpin(pinned_[i]);
+        for (uint32_t i = 0; i < runs_.size(); ++i)
+            runs_[i]->Unref();
+    }
+
+    bool Snapshot::Next(Message& msg) {
+        return merge_.Next(msg);
+    }
+
+    namespace {
+        /* A checkpoint is made of the header, a block for every node, in
+         * depth-first order with parents first, and a block of the messages
+         * that had not reached the tree. A node block is the node record,
+         * its runs (padded to 8 bytes), its messages and, for every run
+         * file of the node, its size as a 64-bit count followed by its
+         * messages. Every block is followed by a 64-bit checksum of its
+         * contents, so that all blocks stay aligned for the messages to be
+         * used in place. */
+        struct CheckpointHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t messageSize;
+            uint32_t b;
+            uint32_t emptyMethod;
+            uint32_t numNodes;
+            uint64_t numPending;
+            // set if the nodes hold data; cleared in hash mode
+            uint32_t treeMode;
+            // of the preceding fields
+            uint32_t checksum;
+        };
+
+        struct CheckpointNode {
+            // index of the parent; the root comes first and has none
+            uint32_t parent;
+            uint32_t level;
+            uint32_t separator;
+            uint32_t numElements;
+            uint32_t numRuns;
+            uint8_t sorted;
+            uint8_t summarized;
+            uint8_t heavy;
+            uint8_t unused;
+            uint32_t numRunFiles;
+            uint32_t unused2;
+        };
+
+        /* Blocks are written a piece at a time, from wherever the pieces
+         * are, but read back in one go. The checksum is therefore chained
+         * over the 64-bit words that every piece is made of, so that it
+         * comes out the same however a block is split up */
+        uint64_t Checksum(const void* buf, size_t len, uint64_t checksum) {
+            const char* p = static_cast<const char*>(buf);
+            for (size_t i = 0; i + sizeof(uint64_t) <= len;
+                    i += sizeof(uint64_t)) {
+                uint64_t word;
+                memcpy(&word, p + i, sizeof(word));
+                checksum = (checksum ^ word) * 0x100000001b3ULL;
+                checksum ^= checksum >> 32;
+            }
+            return checksum;
+        }
+
+        bool WriteChecksummed(FILE* f, const void* buf, size_t len,
+                uint64_t& checksum) {
+            if (len == 0)
+                return true;
+            checksum = Checksum(buf, len, checksum);
+            return (fwrite(buf, 1, len, f) == len);
+        }
+
+        bool WriteChecksum(FILE* f, uint64_t checksum) {
+            return (fwrite(&checksum, sizeof(checksum), 1, f) == 1);
+        }
+
+        /* Point out at the next len bytes of the mapped file, if there are
+         * that many left */
+        bool ReadChecksummed(const char*& p, const char* end, uint64_t len,
+                uint64_t& checksum, const void*& out) {
+            if (static_cast<uint64_t>(end - p) < len)
+                return false;
+            out = p;
+            checksum = Checksum(p, len, checksum);
+            p += len;
+            return true;
+        }
+
+        bool ReadChecksum(const char*& p, const char* end, uint64_t checksum) {
+            uint64_t c;
+            if (static_cast<uint64_t>(end - p) < sizeof(c))
+                return false;
+            memcpy(&c, p, sizeof(c));
+            p += sizeof(c);
+            return (c == checksum);
+        }
+    }
+
+    bool CompressTree::Checkpoint(const char* path) {
+        if (!runDir_.empty()) {
+            fprintf(stderr, "Checkpoint: not supported with a leaf tier\n");
+            return false;
+        }
+        CheckpointHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = kCheckpointMagic;
+        header.version = kCheckpointVersion;
+        header.messageSize = sizeof(Message);
+        header.b = b_;
+        header.emptyMethod = emptyMethod_;
+
+        // messages that haven't reached the tree are written as they are,
+        // to be inserted again on restore
+        std::vector<Message> pending;
+        std::vector<PinnedNode> inputs;
+        std::vector<PinnedNode> nodes;
+        PinAll(pending, inputs, nodes, 0, kNumHashes);
+
+        header.treeMode = !nodes.empty();
+        header.numNodes = nodes.size();
+        header.numPending = pending.size();
+        for (uint32_t i = 0; i < inputs.size(); ++i)
+            header.numPending += inputs[i].num + inputs[i].tail.size();
+        header.checksum = HashUtil::MurmurHash(&header,
+                offsetof(CheckpointHeader, checksum), 0);
+
+        // written next to the previous checkpoint, which is replaced once
+        // the new one is safely on disk
+        std::string tmp = std::string(path) + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        bool ret = (f != NULL);
+        if (ret)
+            ret = (fwrite(&header, sizeof(header), 1, f) == 1);
+        for (uint32_t i = 0; ret && i < nodes.size(); ++i) {
+            const PinnedNode& n = nodes[i];
+            CheckpointNode rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.parent = n.parent;
+            rec.level = n.level;
+            rec.separator = n.separator;
+            rec.numElements = n.num + n.tail.size();
+            rec.numRuns = n.runs.size();
+            rec.sorted = n.sorted;
+            rec.summarized = n.summarized;
+            rec.heavy = n.heavy;
+            rec.numRunFiles = n.runFiles.size();
+            std::vector<uint32_t> runs = n.runs;
+            if (rec.numRuns % 2)
+                runs.push_back(0);
+            uint64_t checksum = 0;
+            ret = WriteChecksummed(f, &rec, sizeof(rec), checksum);
+            if (ret && !runs.empty())
+                ret = WriteChecksummed(f, &runs[0],
+                        runs.size() * sizeof(uint32_t), checksum);
+            if (ret)
+                ret = WriteChecksummed(f, n.messages,
+                        n.num * sizeof(Message), checksum);
+            if (ret && !n.tail.empty())
+                ret = WriteChecksummed(f, &n.tail[0],
+                        n.tail.size() * sizeof(Message), checksum);
+            for (uint32_t j = 0; ret && j < n.runFiles.size(); ++j) {
+                RunFile* run = n.runFiles[j];
+                uint64_t num = run->size();
+                ret = WriteChecksummed(f, &num, sizeof(num), checksum) &&
+                        WriteChecksummed(f, run->begin(),
+                        num * sizeof(Message), checksum);
+            }
+            if (ret)
+                ret = WriteChecksum(f, checksum);
+        }
+        if (ret) {
+            uint64_t checksum = 0;
+            if (!pending.empty())
+                ret = WriteChecksummed(f, &pending[0],
+                        pending.size() * sizeof(Message), checksum);
+            for (uint32_t i = 0; ret && i < inputs.size(); ++i) {
+                const PinnedNode& in = inputs[i];
+                ret = WriteChecksummed(f, in.messages,
+                        in.num * sizeof(Message), checksum);
+                if (ret && !in.tail.empty())
+                    ret = WriteChecksummed(f, &in.tail[0],
+                            in.tail.size() * sizeof(Message), checksum);
+            }
+            if (ret)
+                ret = WriteChecksum(f, checksum);
+        }
+        if (ret)
+            ret = (fflush(f) == 0 && fsync(fileno(f)) == 0);
+        if (f && fclose(f) != 0)
+            ret = false;
+        if (ret)
+            ret = (rename(tmp.c_str(), path) == 0);
+        if (!ret) {
+            fprintf(stderr, "Checkpoint to %s failed: %s\n", path,
+                    strerror(errno));
+            unlink(tmp.c_str());
+        }
+
+        // input nodes hold no runs
+        for (uint32_t i = 0; i < inputs.size(); ++i) {
+            if (inputs[i].messages)
+                Buffer::Unpin(inputs[i].messages);
+        }
+        for (uint32_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].messages)
+                Buffer::Unpin(nodes[i].messages);
+            for (uint32_t j = 0; j < nodes[i].runFiles.size(); ++j)
+                nodes[i].runFiles[j]->Unref();
+        }
+        if (ret)
+            fprintf(stderr, "Checkpointed %lu nodes and %lu pending messages "
+                    "to %s\n", nodes.size(), header.numPending, path);
+        return ret;
+    }
+
+    bool CompressTree::Restore(const char* path) {
+        if (threadsStarted_)
+            return false;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashAgg_->size() > 0)
+            return false;
+#endif
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Can't open checkpoint %s: %s\n", path,
+                    strerror(errno));
+            return false;
+        }
+        struct stat st;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Can't map checkpoint %s\n", path);
+            return false;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+        // check every block before the tree is touched
+        const char* p = static_cast<const char*>(map);
+        const char* end = p + st.st_size;
+        const CheckpointHeader* header = NULL;
+        std::vector<const CheckpointNode*> nodes;
+        std::vector<const uint32_t*> runs;
+        std::vector<const Message*> messages;
+        std::vector<std::vector<MessageSpan> > runFiles;
+        const Message* pending = NULL;
+        const void* out;
+        uint64_t checksum = 0;
+        bool ret = ReadChecksummed(p, end, sizeof(CheckpointHeader),
+                checksum, out);
+        if (ret) {
+            header = static_cast<const CheckpointHeader*>(out);
+            ret = (header->magic == kCheckpointMagic &&
+                    header->version == kCheckpointVersion &&
+                    header->checksum == HashUtil::MurmurHash(header,
+                            offsetof(CheckpointHeader, checksum), 0) &&
+                    header->messageSize == sizeof(Message) &&
+                    header->b == b_ &&
+                    header->emptyMethod ==
+                            static_cast<uint32_t>(emptyMethod_) &&
+                    (header->treeMode != 0) == (header->numNodes > 0));
+        }
+        for (uint32_t i = 0; ret && i < header->numNodes; ++i) {
+            checksum = 0;
+            ret = ReadChecksummed(p, end, sizeof(CheckpointNode), checksum,
+                    out);
+            if (!ret)
+                break;
+            const CheckpointNode* rec =
+                    static_cast<const CheckpointNode*>(out);
+            // parents come before their children, one level up
+            if (i == 0)
+                ret = (rec->parent == UINT32_MAX);
+            else
+                ret = (rec->parent < i &&
+                        nodes[rec->parent]->level == rec->level + 1);
+            ret = ret && rec->numElements <= Buffer::kMaximumElements &&
+                    rec->numRuns <= rec->numElements;
+            ret = ret && ReadChecksummed(p, end, (rec->numRuns +
+                    rec->numRuns % 2) * sizeof(uint32_t), checksum, out);
+            if (!ret)
+                break;
+            nodes.push_back(rec);
+            runs.push_back(static_cast<const uint32_t*>(out));
+            ret = ReadChecksummed(p, end, static_cast<uint64_t>(
+                    rec->numElements) * sizeof(Message), checksum, out);
+            messages.push_back(static_cast<const Message*>(out));
+            runFiles.push_back(std::vector<MessageSpan>());
+            for (uint32_t j = 0; ret && j < rec->numRunFiles; ++j) {
+                uint64_t num;
+                ret = ReadChecksummed(p, end, sizeof(num), checksum, out);
+                if (!ret)
+                    break;
+                memcpy(&num, out, sizeof(num));
+                ret = num <= static_cast<uint64_t>(end - p) /
+                        sizeof(Message) && num <= UINT32_MAX &&
+                        ReadChecksummed(p, end, num * sizeof(Message),
+                        checksum, out);
+                MessageSpan span = {static_cast<const Message*>(out),
+                        static_cast<uint32_t>(num)};
+                runFiles.back().push_back(span);
+            }
+            ret = ret && ReadChecksum(p, end, checksum);
+        }
+        if (ret) {
+            checksum = 0;
+            ret = header->numPending <= static_cast<uint64_t>(end - p) /
+                    sizeof(Message) &&
+                    ReadChecksummed(p, end, header->numPending *
+                    sizeof(Message), checksum, out) &&
+                    ReadChecksum(p, end, checksum) && p == end;
+            pending = static_cast<const Message*>(out);
+        }
+        if (!ret) {
+            fprintf(stderr, "Checkpoint %s is corrupt or doesn't match the "
+                    "tree\n", path);
+            munmap(map, st.st_size);
+            return false;
+        }
+        // run files are copied out of the mapping before the tree is
+        // touched, as that can fail
+        std::vector<std::vector<RunFile*> > restoredRuns(nodes.size());
+        for (uint32_t i = 0; ret && i < runFiles.size(); ++i) {
+            for (uint32_t j = 0; ret && j < runFiles[i].size(); ++j) {
+                RunFile* run = RunFile::Create(runDir_,
+                        runFiles[i][j].messages, runFiles[i][j].num);
+                ret = (run != NULL);
+                if (ret)
+                    restoredRuns[i].push_back(run);
+            }
+        }
+        if (!ret) {
+            for (uint32_t i = 0; i < restoredRuns.size(); ++i) {
+                for (uint32_t j = 0; j < restoredRuns[i].size(); ++j)
+                    restoredRuns[i][j]->Unref();
+            }
+            munmap(map, st.st_size);
+            return false;
+        }
+
+        if (header->treeMode) {
+            // the tree is rebuilt as it was; no skeleton
+            uint32_t presplitLeaves = presplitLeaves_;
+            presplitLeaves_ = 0;
+            StartThreads();
+            presplitLeaves_ = presplitLeaves;
+#ifdef ENABLE_HASH_AGGREGATION
+            hashMode_ = false;
+#endif
+            std::vector<Node*> restored(nodes.size());
+            for (uint32_t i = 0; i < nodes.size(); ++i) {
+                const CheckpointNode* rec = nodes[i];
+                Node* n = rootNode_;
+                if (i > 0) {
+                    n = new Node(this, rec->level);
+                    n->parent_ = restored[rec->parent];
+                    n->parent_->children_.push_back(n);
+                }
+                n->level_ = rec->level;
+                n->separator_ = rec->separator;
+                Buffer& buf = n->buffer_;
+                if (rec->numElements > 0) {
+                    buf.Allocate();
+                    std::copy(messages[i], messages[i] + rec->numElements,
+                            buf.messages_);
+                    buf.set_num_elements(rec->numElements);
+                    buf.runs_.assign(runs[i], runs[i] + rec->numRuns);
+                    buf.sorted_ = rec->sorted;
+                    if (rec->summarized)
+                        buf.Summarize();
+                } else if (i > 0) {
+                    buf.Deallocate();
+                }
+                if (rec->heavy) {
+                    n->heavy_ = true;
+                    numHeavyLeaves_++;
+                }
+                n->runFiles_ = restoredRuns[i];
+                restored[i] = n;
+            }
+            numLeaves_ = 0;
+            for (uint32_t i = 0; i < restored.size(); ++i) {
+                if (restored[i]->isLeaf())
+                    numLeaves_++;
+                else
+                    restored[i]->UpdateSeparators();
+            }
+            allFlush_ = false;
+            // a full root buffer is always being emptied
+            if (!rootNode_->buffer_.empty())
+                rootNode_->schedule(EMPTY);
+        }
+        if (header->numPending > 0)
+            bulk_insert(pending, header->numPending);
+        fprintf(stderr, "Restored %lu nodes and %lu pending messages from "
+                "%s\n", nodes.size(), header->numPending, path);
+        munmap(map, st.st_size);
+        return true;
+    }
+
     bool CompressTree::bulk_read(Message* msg_list, uint64_t& num_read,
             uint64_t max) {
         num_read = 0;
@@ -95,49 +1227,519 @@ namespace gpucbt {
     }
 
     bool CompressTree::nextValue(Message& msg) {
-        if (!allFlush_) {
-            FlushBuffers();
-            lastLeafRead_ = 0;
-            lastOffset_ = 0;
-            lastElement_ = 0;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_)
+            return NextHashValue(msg);
+#endif
+        if (finalizeMethod_ == MERGE_ON_READ)
+            return NextMergedValue(msg);
+        if (!allFlush_)
+            StartLeafRead();
+        if (readLeaf_ == NULL) {
+            FinishRead();
+            return false;
+        }
+
+        if (readLeaf_->runFiles_.empty()) {
+            msg = readLeaf_->buffer_.messages_[lastElement_];
+            lastElement_++;
+        } else {
+            readMerge_.Next(msg);
+        }
 
-            /* Wait for all outstanding compression work to finish */
-            compressor_->WaitUntilCompletionNoticeReceived();
+        // the last value is returned along with false, so move on right
+        // away, even if that means waiting for the flush
+        if (LeafDone() && !NextLeaf()) {
+            FinishRead();
+            return false;
+        }
+        return true;
+    }
+
+    bool CompressTree::ReadSpan(MessageSpan& span, uint32_t max) {
+        span.messages = NULL;
+        span.num = 0;
+        if (readFinished_)
+            return false;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_) {
+            if (!allFlush_) {
+                hashAgg_->Finalize();
+                lastElement_ = 0;
+                allFlush_ = true;
+            }
+            uint32_t num = hashAgg_->size() - lastElement_;
+            if (num == 0) {
+                FinishRead();
+                return false;
+            }
+            if (max > 0 && num > max)
+                num = max;
+            span.messages = hashAgg_->messages() + lastElement_;
+            span.num = num;
+            lastElement_ += num;
+            pinnedSpans_++;
+            return true;
+        }
+#endif
+        if (!threadsStarted_)
+            return false;
+        if (finalizeMethod_ == MERGE_ON_READ) {
+#ifdef ENABLE_ASSERT_CHECKS
+            assert(pinnedSpans_ == 0);
+#endif
+            if (!allFlush_) {
+                MergeBuffers();
+                allFlush_ = true;
+            }
+            uint32_t num = (max > 0? max : kMergeSpanSize);
+            spanMessages_.clear();
+            Message msg;
+            while (spanMessages_.size() < num && readMerge_.Next(msg))
+                spanMessages_.push_back(msg);
+            if (spanMessages_.empty()) {
+                FinishRead();
+                return false;
+            }
+            span.messages = &spanMessages_[0];
+            span.num = spanMessages_.size();
+            pinnedSpans_++;
+            return true;
+        }
+
+        if (!allFlush_)
+            StartLeafRead();
+        // move on to the next leaf only when asked for more, so that the
+        // current span isn't held up by the flush
+        if (readLeaf_ != NULL && LeafDone())
+            NextLeaf();
+        while (readLeaf_ != NULL && !readLeaf_->runFiles_.empty()) {
+            uint32_t num = (max > 0? max : kMergeSpanSize);
+            spanMessages_.clear();
+            Message msg;
+            while (spanMessages_.size() < num && readMerge_.Next(msg))
+                spanMessages_.push_back(msg);
+            if (!spanMessages_.empty()) {
+                span.messages = &spanMessages_[0];
+                span.num = spanMessages_.size();
+                pinnedSpans_++;
+                return true;
+            }
+            // the leaf's runs held nothing more
+            NextLeaf();
+        }
+        if (readLeaf_ == NULL) {
+            FinishRead();
+            return false;
+        }
+        Buffer& buf = readLeaf_->buffer_;
+        uint32_t num = buf.num_elements() - lastElement_;
+        if (max > 0 && num > max)
+            num = max;
+        span.messages = buf.messages_ + lastElement_;
+        span.num = num;
+        lastElement_ += num;
+        pinnedSpans_++;
+        return true;
+    }
+
+    void CompressTree::ReleaseSpan() {
+        if (pinnedSpans_ == 0)
+            return;
+        if (--pinnedSpans_ == 0 && readFinished_)
+            FinishRead();
+    }
+
+    bool CompressTree::PartitionedRead(uint32_t num_partitions,
+            std::vector<PartitionIterator>& parts) {
+        parts.clear();
+        if (num_partitions == 0)
+            return false;
+        std::vector<MessageSpan> spans;
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_) {
+            hashAgg_->Finalize();
             allFlush_ = true;
+            MessageSpan span = {hashAgg_->messages(), hashAgg_->size()};
+            spans.push_back(span);
+        } else
+#endif
+        {
+            if (!threadsStarted_)
+                return false;
+            FlushBuffers();
+            allFlush_ = true;
+            for (uint32_t i = 0; i < allLeaves_.size(); ++i) {
+                Node* leaf = allLeaves_[i];
+                if (leaf->runFiles_.empty()) {
+                    Buffer& buf = leaf->buffer_;
+                    MessageSpan span = {buf.messages_, buf.num_elements()};
+                    spans.push_back(span);
+                    continue;
+                }
+                // partitions are cut by position, so a leaf kept on disk
+                // is merged into a single run first
+                if (!leaf->CompactRuns())
+                    return false;
+                RunFile* run = leaf->runFiles_[0];
+                MessageSpan span = {run->begin(),
+                        static_cast<uint32_t>(run->size())};
+                spans.push_back(span);
+            }
+        }
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < spans.size(); ++i)
+            total += spans[i].num;
+
+        // cut the sequence of leaves, within a leaf if necessary, every
+        // total / num_partitions aggregates
+        parts.resize(num_partitions);
+        uint32_t cur = 0;
+        uint64_t offset = 0;
+        for (uint32_t p = 0; p < num_partitions; ++p) {
+            uint64_t want = total * (p + 1) / num_partitions -
+                    total * p / num_partitions;
+            parts[p].size_ = want;
+            while (want > 0) {
+                MessageSpan span = spans[cur];
+                span.messages += offset;
+                span.num -= offset;
+                if (span.num > want)
+                    span.num = want;
+                if (span.num > 0)
+                    parts[p].spans_.push_back(span);
+                want -= span.num;
+                offset += span.num;
+                if (offset == spans[cur].num) {
+                    cur++;
+                    offset = 0;
+                }
+            }
+        }
+        // the partitions pin the tree like a span does
+        pinnedSpans_++;
+        return true;
+    }
+
+    void CompressTree::EndPartitionedRead() {
+        readFinished_ = true;
+        ReleaseSpan();
+    }
+
+    void CompressTree::StartLeafRead() {
+        fprintf(stderr, "Starting to flush\n");
+        DrainIntoInputNode();
+
+        // every buffer is emptied from here on; the flush has reached the
+        // root once this input node has been submitted for emptying
+        pthread_rwlock_wrlock(&treeLock_);
+        flushNode_ = inputNode_;
+        flushReachedRoot_ = false;
+        pthread_rwlock_unlock(&treeLock_);
+        emptyType_ = ALWAYS;
+        inputNode_->schedule(SORT);
+        allFlush_ = true;
+
+        readLeaf_ = NULL;
+        NextLeaf();
+    }
 
-            // page in and decompress first leaf
-            Node* curLeaf = allLeaves_[0];
-            while (curLeaf->buffer_.num_elements() == 0)
-                curLeaf = allLeaves_[++lastLeafRead_];
+    bool CompressTree::NextLeaf() {
+        lastElement_ = 0;
+        // skip empty leaves; pre-split leaves may never receive any
+        // messages
+        do {
+            if (readLeaf_ != NULL && readLeaf_->separator_ == UINT32_MAX) {
+                readLeaf_ = NULL;
+                return false;
+            }
+            readLeaf_ = WaitForFinalLeaf(readLeaf_ == NULL? 0 :
+                    readLeaf_->separator_);
+        } while (readLeaf_->buffer_.empty() && readLeaf_->runFiles_.empty());
+        if (!readLeaf_->runFiles_.empty())
+            MergeLeafRuns(readLeaf_);
+        return true;
+    }
+
+    void CompressTree::MergeLeafRuns(Node* leaf) {
+        readMerge_.Clear();
+        for (uint32_t i = 0; i < leaf->runFiles_.size(); ++i)
+            readMerge_.Add(leaf->runFiles_[i]->begin(),
+                    leaf->runFiles_[i]->end());
+        Buffer& buf = leaf->buffer_;
+        if (!buf.empty()) {
+            if (!buf.sorted_)
+                buf.Sort();
+            readMerge_.Add(buf.messages_, buf.messages_ + buf.num_elements());
         }
+    }
 
-        Node* curLeaf = allLeaves_[lastLeafRead_];
-        msg = curLeaf->buffer_.messages_[lastElement_];
-        lastElement_++;
+    bool CompressTree::LeafDone() const {
+        if (readLeaf_->runFiles_.empty())
+            return (lastElement_ >= readLeaf_->buffer_.num_elements());
+        return readMerge_.empty();
+    }
+
+    Node* CompressTree::WaitForFinalLeaf(uint32_t hash) {
+        Node* leaf;
+        // the slaves broadcast after every EMPTY while not holding the
+        // tree lock; holding flushProgressMutex_ across the check means
+        // that no broadcast is missed
+        pthread_mutex_lock(&flushProgressMutex_);
+        while (true) {
+            pthread_rwlock_wrlock(&treeLock_);
+            leaf = FinalLeaf(hash);
+            pthread_rwlock_unlock(&treeLock_);
+            if (leaf)
+                break;
+            pthread_cond_wait(&flushProgress_, &flushProgressMutex_);
+        }
+        pthread_mutex_unlock(&flushProgressMutex_);
+        return leaf;
+    }
 
-        if (lastElement_ >= curLeaf->buffer_.num_elements()) {
-            if (++lastLeafRead_ == allLeaves_.size()) {
+    Node* CompressTree::FinalLeaf(uint32_t hash) {
+        // data still on its way to the root
+        if (!flushReachedRoot_)
+            return NULL;
+        for (uint32_t i = 0; i < inputNodes_.size(); ++i) {
+            if (!inputNodes_[i]->buffer_.empty())
+                return NULL;
+        }
+        // messages only move down, so the leaf is final once the flush has
+        // passed every node on the path to it
+        Node* n = rootNode_;
+        while (true) {
+            if (n->getQueueStatus() != NONE)
+                return NULL;
+            if (n->isLeaf())
+                return n;
+            if (!n->buffer_.empty())
+                return NULL;
+            n = n->children_[n->findChild(hash)];
+        }
+    }
+
+    void CompressTree::FinishRead() {
+        // pinned spans still point into the buffers
+        if (pinnedSpans_ > 0) {
+            readFinished_ = true;
+            return;
+        }
+        readFinished_ = false;
+        // a reset counts as a new epoch, whatever mode the tree was in
+        if (recycle_) {
+            Reset(keepSkeleton_);
+            return;
+        }
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_) {
+            ResetHashMode();
+            return;
+        }
+#endif
 #ifdef CT_NODE_DEBUG
-                fprintf(stderr, "Emptying tree!\n");
+        fprintf(stderr, "Emptying tree!\n");
 #endif
-                EmptyTree();
-                StopThreads();
-                return false;
+        EmptyTree();
+        StopThreads();
+    }
+
+    PartitionIterator::PartitionIterator() :
+            curSpan_(0),
+            curOffset_(0),
+            size_(0) {
+    }
+
+    bool PartitionIterator::NextSpan(MessageSpan& span, uint32_t max) {
+        if (curSpan_ >= spans_.size())
+            return false;
+        const MessageSpan& cur = spans_[curSpan_];
+        span.messages = cur.messages + curOffset_;
+        span.num = cur.num - curOffset_;
+        if (max > 0 && span.num > max)
+            span.num = max;
+        curOffset_ += span.num;
+        if (curOffset_ == cur.num) {
+            curSpan_++;
+            curOffset_ = 0;
+        }
+        return true;
+    }
+
+    bool PartitionIterator::Next(Message& msg) {
+        MessageSpan span;
+        if (!NextSpan(span, 1))
+            return false;
+        msg = span.messages[0];
+        return true;
+    }
+
+    uint64_t PartitionIterator::size() const {
+        return size_;
+    }
+
+#ifdef ENABLE_HASH_AGGREGATION
+    uint64_t CompressTree::HashAggregate(const Message* msgs, uint64_t num,
+            bool block) {
+        uint64_t consumed = num;
+        bool full = false;
+        pthread_mutex_lock(&inputMutex_);
+        for (uint64_t i = 0; i < num; ++i) {
+            cardinality_->Add(msgs[i].hash());
+            if (!hashAgg_->Insert(msgs[i])) {
+                // table is full; msgs[i] goes to the tree
+                consumed = i;
+                full = true;
+                break;
             }
-            Node *n = allLeaves_[lastLeafRead_];
-            while (curLeaf->buffer_.num_elements() == 0)
-                curLeaf = allLeaves_[++lastLeafRead_];
+            if (++numHashAggregated_ % kCardinalityCheckInterval == 0 &&
+                    cardinality_->Estimate() > kHashAggregationLimit) {
+                consumed = i + 1;
+                full = true;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&inputMutex_);
+        if (full)
+            SwitchToTreeMode(block);
+        return consumed;
+    }
+
+    void CompressTree::SwitchToTreeMode(bool block) {
+        fprintf(stderr, "Switching to tree; estimated distinct keys: %lu\n",
+                cardinality_->Estimate());
+        if (!threadsStarted_) {
+            StartThreads();
+        }
+        // Nothing is staged in hash mode and the staging area is as large
+        // as the table, so the table is moved there in one go, without
+        // waiting for the input nodes, and drained from there
+        pthread_mutex_lock(&inputMutex_);
+        hashAgg_->Finalize();
+        Stage(hashAgg_->messages(), hashAgg_->size());
+        hashAgg_->Clear();
+        hashMode_ = false;
+        pthread_mutex_unlock(&inputMutex_);
+        DrainStaged(block);
+    }
+
+    bool CompressTree::NextHashValue(Message& msg) {
+        if (!allFlush_) {
+            hashAgg_->Finalize();
             lastElement_ = 0;
+            allFlush_ = true;
+        }
+        if (lastElement_ >= hashAgg_->size()) {
+            FinishRead();
+            return false;
+        }
+        msg = hashAgg_->messages()[lastElement_++];
+        if (lastElement_ >= hashAgg_->size()) {
+            FinishRead();
+            return false;
         }
         return true;
     }
 
+    void CompressTree::ResetHashMode() {
+        hashAgg_->Clear();
+        cardinality_->Clear();
+        numHashAggregated_ = 0;
+        hashMode_ = true;
+        allFlush_ = true;
+        lastElement_ = 0;
+    }
+#endif  // ENABLE_HASH_AGGREGATION
+
     void CompressTree::clear() {
+        if (recycle_) {
+            Reset(keepSkeleton_);
+            return;
+        }
+#ifdef ENABLE_HASH_AGGREGATION
+        if (hashMode_) {
+            ResetHashMode();
+            return;
+        }
+#endif
         EmptyTree();
         StopThreads();
     }
 
+    void CompressTree::SetRecycle(bool recycle, bool keep_skeleton) {
+        recycle_ = recycle;
+        keepSkeleton_ = keep_skeleton;
+        UpdatePooledArrays();
+    }
+
+    void CompressTree::Reset(bool keep_skeleton) {
+        // staged and cached messages belong to the cycle being discarded
+        numStaged_ = 0;
+#ifdef ENABLE_HOTKEY_CACHE
+        Message msg;
+        while (hotKeys_->Drain(msg)) {
+        }
+#endif  // ENABLE_HOTKEY_CACHE
+
+        if (threadsStarted_) {
+            // let the slaves finish whatever they were given, e.g. the
+            // leaves being split at the end of a flush
+            WaitForSlaves();
+
+            pthread_rwlock_wrlock(&treeLock_);
+            pthread_mutex_lock(&emptyRootNodesMutex_);
+            emptyRootNodes_.clear();
+            for (uint32_t i = 0; i < inputNodes_.size(); ++i) {
+                inputNodes_[i]->buffer_.SetEmpty();
+                if (inputNodes_[i] != inputNode_)
+                    emptyRootNodes_.push_back(inputNodes_[i]);
+            }
+            pthread_mutex_unlock(&emptyRootNodesMutex_);
+
+            if (keep_skeleton) {
+                std::deque<Node*> visitQueue;
+                visitQueue.push_back(rootNode_);
+                while (!visitQueue.empty()) {
+                    Node* n = visitQueue.front();
+                    visitQueue.pop_front();
+                    for (uint32_t i = 0; i < n->children_.size(); ++i)
+                        visitQueue.push_back(n->children_[i]);
+                    n->buffer_.SetEmpty();
+                    n->heavy_ = false;
+                    for (uint32_t i = 0; i < n->runFiles_.size(); ++i)
+                        n->runFiles_[i]->Unref();
+                    n->runFiles_.clear();
+                }
+                numHeavyLeaves_ = 0;
+            } else {
+                DeleteNodes();
+                BuildRoot();
+            }
+            emptyType_ = IF_FULL;
+            pthread_rwlock_unlock(&treeLock_);
+        }
+        ResetState();
+        pinnedSpans_ = 0;
+        readFinished_ = false;
+        epoch_++;
+    }
+
+    uint64_t CompressTree::epoch() const {
+        return epoch_;
+    }
+
     void CompressTree::EmptyTree() {
+        // the last leaf can be read while slaves are still splitting leaves
+        // or finishing up with nodes
+        if (threadsStarted_)
+            WaitForSlaves();
+        DeleteNodes();
+        ResetState();
+        nodeCtr = 0;
+    }
+
+    void CompressTree::DeleteNodes() {
         std::deque<Node*> delList1;
         std::deque<Node*> delList2;
         delList1.push_back(rootNode_);
@@ -152,16 +1754,66 @@ namespace gpucbt {
         while (!delList2.empty()) {
             Node* n = delList2.front();
             delList2.pop_front();
+            // hand the memory back to the buffer pool
+            n->buffer_.Deallocate();
             delete n;
         }
+        rootNode_ = NULL;
+        numHeavyLeaves_ = 0;
+        numLeaves_ = 0;
+    }
+
+    void CompressTree::ResetState() {
         allLeaves_.clear();
-        leavesToBeEmptied_.clear();
+        numStaged_ = 0;
+#ifdef ENABLE_HASH_AGGREGATION
+        ResetHashMode();
+#endif
         allFlush_ = true;
-        lastLeafRead_ = 0;
+        readLeaf_ = NULL;
         lastOffset_ = 0;
         lastElement_ = 0;
+        readMerge_.Clear();
+        flushNode_ = NULL;
+        flushReachedRoot_ = false;
+    }
 
-        nodeCtr = 0;
+    void CompressTree::WaitForSlaves() {
+        // Checking that each slave is idle in turn isn't enough: work
+        // passes from the emptier to the merger and back, and can slip
+        // past the checks
+        pthread_mutex_lock(&pendingActionsMutex_);
+        while (pendingActions_ > 0)
+            pthread_cond_wait(&actionsDone_, &pendingActionsMutex_);
+        pthread_mutex_unlock(&pendingActionsMutex_);
+    }
+
+    void CompressTree::ActionScheduled() {
+        pthread_mutex_lock(&pendingActionsMutex_);
+        pendingActions_++;
+        pthread_mutex_unlock(&pendingActionsMutex_);
+    }
+
+    void CompressTree::ActionPerformed() {
+        pthread_mutex_lock(&pendingActionsMutex_);
+        if (--pendingActions_ == 0)
+            pthread_cond_broadcast(&actionsDone_);
+        pthread_mutex_unlock(&pendingActionsMutex_);
+    }
+
+    void CompressTree::DrainIntoInputNode() {
+        if (numStaged_ > 0)
+            DrainStaged(/*block = */true);
+#ifdef ENABLE_HOTKEY_CACHE
+        Message msg;
+        while (hotKeys_->Drain(msg)) {
+            if (inputNode_->isFull())
+                SwapInputNode();
+            inputNode_->insert(msg);
+        }
+        fprintf(stderr, "Hot-key cache: %lu hits, %lu evictions\n",
+                hotKeys_->hits(), hotKeys_->evictions());
+#endif  // ENABLE_HOTKEY_CACHE
     }
 
     bool CompressTree::FlushBuffers() {
@@ -169,18 +1821,15 @@ namespace gpucbt {
         std::deque<Node*> visitQueue;
         fprintf(stderr, "Starting to flush\n");
 
+        // staged messages have to make it into the tree before flushing
+        DrainIntoInputNode();
+
         emptyType_ = ALWAYS;
         inputNode_->schedule(SORT);
 
         /* wait for all nodes to be sorted and emptied
            before proceeding */
-        do {
-            merger_->WaitUntilCompletionNoticeReceived();
-            emptier_->WaitUntilCompletionNoticeReceived();
-            compressor_->WaitUntilCompletionNoticeReceived();
-        } while (!merger_->empty() ||
-                !emptier_->empty() ||
-                !compressor_->empty());
+        WaitForSlaves();
 
         // add all leaves;
         visitQueue.push_back(rootNode_);
@@ -204,7 +1853,8 @@ namespace gpucbt {
                 visitQueue.push_back(curNode->children_[i]);
             }
         }
-        fprintf(stderr, "Tree has %ld leaves\n", allLeaves_.size());
+        fprintf(stderr, "Tree has %ld leaves (%lu heavy-key)\n",
+                allLeaves_.size(), numHeavyLeaves_);
         uint32_t depth = 1;
         curNode = rootNode_;
         while (curNode->children_.size() > 0) {
@@ -213,45 +1863,122 @@ namespace gpucbt {
         }
         fprintf(stderr, "Tree has depth: %d\n", depth);
         uint64_t numit = 0;
-        for (uint64_t i = 0; i < allLeaves_.size(); ++i)
+        uint64_t numOnDisk = 0;
+        for (uint64_t i = 0; i < allLeaves_.size(); ++i) {
             numit += allLeaves_[i]->buffer_.num_elements();
-        fprintf(stderr, "Tree has %ld elements\n", numit);
-        return true;
-    }
+            std::vector<RunFile*>& runs = allLeaves_[i]->runFiles_;
+            for (uint32_t j = 0; j < runs.size(); ++j)
+                numOnDisk += runs[j]->size();
+        }
+        fprintf(stderr, "Tree has %ld elements (%lu more in runs on disk)\n",
+                numit, numOnDisk);
 
-    bool CompressTree::AddLeafToEmpty(Node* node) {
-        leavesToBeEmptied_.push_back(node);
+        pthread_mutex_lock(&emptyRootNodesMutex_);
+        fprintf(stderr, "Inserter stalls (usecs: count): ");
+        for (uint32_t i = 0; i < kStallHistogramBuckets; ++i) {
+            if (stallHistogram_[i] > 0)
+                fprintf(stderr, "%lu: %lu, ", 1UL << i, stallHistogram_[i]);
+        }
+        fprintf(stderr, "would-block: %lu\n", numWouldBlock_);
+        pthread_mutex_unlock(&emptyRootNodesMutex_);
         return true;
     }
 
-    /* A full leaf is handled by splitting the leaf into two leaves.*/
-    void CompressTree::HandleFullLeaves() {
-        while (!leavesToBeEmptied_.empty()) {
-            Node* node = leavesToBeEmptied_.front();
-            leavesToBeEmptied_.pop_front();
+    bool CompressTree::MergeBuffers() {
+        fprintf(stderr, "Starting read-time merge\n");
+        DrainIntoInputNode();
 
-            Node* newLeaf = node->SplitLeaf();
+        // push the last input buffer into the root, but only empty buffers
+        // that are full, as during insertion
+        inputNode_->schedule(SORT);
+        WaitForSlaves();
 
-            Node *l1 = NULL, *l2 = NULL;
-            if (node->isFull()) {
-                l1 = node->SplitLeaf();
-                assert(l1);
+        // Buffers filled by SORT_AND_SPLIT parents are made of sorted runs,
+        // which are merged as they are. Only the others need sorting.
+        uint64_t numMessages = 0;
+        uint32_t numBuffers = 0;
+        uint32_t numSorted = 0;
+        std::deque<Node*> visitQueue;
+        visitQueue.push_back(rootNode_);
+        while (!visitQueue.empty()) {
+            Node* n = visitQueue.front();
+            visitQueue.pop_front();
+            for (uint32_t i = 0; i < n->children_.size(); ++i)
+                visitQueue.push_back(n->children_[i]);
+            for (uint32_t i = 0; i < n->runFiles_.size(); ++i) {
+                RunFile* run = n->runFiles_[i];
+                readMerge_.Add(run->begin(), run->end());
+                numMessages += run->size();
             }
-            if (newLeaf && newLeaf->isFull()) {
-                l2 = newLeaf->SplitLeaf();
-                assert(l2);
+            Buffer& buf = n->buffer_;
+            if (buf.empty())
+                continue;
+            uint32_t num = buf.num_elements();
+            if (!buf.sorted_ && (buf.runs_.empty() ||
+                    buf.runs_.back() != num)) {
+                buf.Sort();
+                numSorted++;
             }
-#ifdef CT_NODE_DEBUG
-            fprintf(stderr, "Leaf node %d removed from full-leaf-list\n",
-                    node->id_);
-#endif
-            // % WHY?
-            //node->setQueueStatus(NONE);
+            if (buf.sorted_) {
+                readMerge_.Add(buf.messages_, buf.messages_ + num);
+            } else {
+                uint32_t start = 0;
+                for (uint32_t i = 0; i < buf.runs_.size(); ++i) {
+                    readMerge_.Add(buf.messages_ + start,
+                            buf.messages_ + buf.runs_[i]);
+                    start = buf.runs_[i];
+                }
+            }
+            numMessages += num;
+            numBuffers++;
+        }
+        fprintf(stderr, "Merging %lu messages in %u segments from %u "
+                "buffers (%u sorted at read time)\n", numMessages,
+                readMerge_.num_segments(), numBuffers, numSorted);
+        return true;
+    }
+
+    bool CompressTree::NextMergedValue(Message& msg) {
+        if (!threadsStarted_)
+            return false;
+        if (!allFlush_) {
+            MergeBuffers();
+            allFlush_ = true;
+        }
+        readMerge_.Next(msg);
+        if (readMerge_.empty()) {
+            FinishRead();
+            return false;
         }
+        return true;
     }
 
-    Node* CompressTree::GetEmptyRootNode() {
+    bool CompressTree::SwapInputNode(bool block) {
+        // get an empty root. This function can block until there are
+        // empty roots available
+        Node* e = GetEmptyRootNode(block);
+        if (!e)
+            return false;
+
+        // add inputNode_ to be sorted
+        inputNode_->schedule(SORT);
+        inputNode_ = e;
+#ifdef CT_NODE_DEBUG
+        fprintf(stderr, "Now inputting into node %d\n", inputNode_->id());
+#endif  // CT_NODE_DEBUG
+        return true;
+    }
+
+    Node* CompressTree::GetEmptyRootNode(bool block) {
+        timeval start, end;
         pthread_mutex_lock(&emptyRootNodesMutex_);
+        if (emptyRootNodes_.empty()) {
+            if (!block) {
+                pthread_mutex_unlock(&emptyRootNodesMutex_);
+                return NULL;
+            }
+            gettimeofday(&start, NULL);
+        }
         while (emptyRootNodes_.empty()) {
 #ifdef CT_NODE_DEBUG
             if (!rootNode_->buffer_.empty())
@@ -266,6 +1993,15 @@ namespace gpucbt {
 #ifdef CT_NODE_DEBUG
             fprintf(stderr, "inserter fingered\n");
 #endif
+            if (!emptyRootNodes_.empty()) {
+                gettimeofday(&end, NULL);
+                uint64_t usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+                        end.tv_usec - start.tv_usec;
+                uint32_t bucket = 0;
+                while ((usecs >>= 1) && bucket < kStallHistogramBuckets - 1)
+                    bucket++;
+                stallHistogram_[bucket]++;
+            }
         }
         Node* e = emptyRootNodes_.front();
         emptyRootNodes_.pop_front();
@@ -273,6 +2009,84 @@ namespace gpucbt {
         return e;
     }
 
+    void CompressTree::GetStallHistogram(std::vector<uint64_t>& hist) {
+        pthread_mutex_lock(&emptyRootNodesMutex_);
+        hist.assign(stallHistogram_, stallHistogram_ + kStallHistogramBuckets);
+        pthread_mutex_unlock(&emptyRootNodesMutex_);
+    }
+
+    bool CompressTree::Presplit(uint32_t num_leaves,
+            const std::vector<uint64_t>& histogram) {
+        if (threadsStarted_ || num_leaves < 2)
+            return false;
+        presplitLeaves_ = num_leaves;
+        presplitSeparators_.clear();
+        if (histogram.empty())
+            return true;
+
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < histogram.size(); ++i)
+            total += histogram[i];
+        if (total == 0)
+            return false;
+
+        // walk the cumulative distribution, interpolating linearly inside
+        // buckets
+        uint64_t width = (1ULL << 32) / histogram.size();
+        uint64_t cum = 0;
+        uint32_t bucket = 0;
+        for (uint32_t j = 1; j < num_leaves; ++j) {
+            uint64_t target = total * j / num_leaves;
+            while (bucket < histogram.size() &&
+                    cum + histogram[bucket] <= target)
+                cum += histogram[bucket++];
+            if (bucket == histogram.size())
+                break;
+            uint64_t sep = bucket * width +
+                    width * (target - cum) / histogram[bucket];
+            if (sep == 0 || sep >= UINT32_MAX)
+                continue;
+            if (presplitSeparators_.empty() ||
+                    sep > presplitSeparators_.back())
+                presplitSeparators_.push_back(sep);
+        }
+        return true;
+    }
+
+    bool CompressTree::SetLeafTier(const char* dir, uint32_t max_leaves) {
+        if (threadsStarted_ || max_leaves == 0)
+            return false;
+        if (access(dir, W_OK | X_OK) != 0) {
+            perror("SetLeafTier: run directory isn't writable");
+            return false;
+        }
+        runDir_ = dir;
+        maxMemoryLeaves_ = max_leaves;
+        return true;
+    }
+
+    bool CompressTree::SetAffinity(const std::vector<uint32_t>& cpus) {
+        if (threadsStarted_ || cpus.empty())
+            return false;
+        CPU_ZERO(&affinity_);
+        for (uint32_t i = 0; i < cpus.size(); ++i) {
+            if (cpus[i] >= CPU_SETSIZE)
+                return false;
+            CPU_SET(cpus[i], &affinity_);
+        }
+        pinThreads_ = true;
+        return true;
+    }
+
+    bool CompressTree::ShouldWriteRun(Node* leaf) {
+        // a leaf that has written runs can't be split any more
+        if (!leaf->runFiles_.empty())
+            return true;
+        if (runDir_.empty())
+            return false;
+        return (numLeaves_ >= maxMemoryLeaves_);
+    }
+
     void CompressTree::AddEmptyRootNode(Node* n) {
         bool no_empty_nodes = false;
         pthread_mutex_lock(&emptyRootNodesMutex_);
@@ -298,29 +2112,70 @@ namespace gpucbt {
     }
 
     void CompressTree::SubmitNodeForEmptying(Node* n) {
-        // perform the switch, schedule root, add node to empty list
-        Buffer temp = rootNode_->buffer_;
-        rootNode_->buffer_ = n->buffer_;
-        rootNode_->schedule(EMPTY);
+        // Called with the tree lock held, exclusively if a pre-split is
+        // pending. Lookup() locks the root before the input nodes, so it
+        // finds the messages in one or the other
+        Node* root = rootNode_;
+        pthread_mutex_lock(&root->bufferMutex_);
+        pthread_mutex_lock(&n->bufferMutex_);
+        // sample the first root buffer if pre-splitting was requested
+        if (presplitPending_) {
+            presplitPending_ = false;
+            uint32_t num = n->buffer_.num_elements();
+            uint32_t stride = num / kPresplitSampleSize + 1;
+            std::vector<uint32_t> sample;
+            for (uint32_t i = 0; i < num; i += stride)
+                sample.push_back(n->buffer_.messages_[i].hash());
+            std::sort(sample.begin(), sample.end());
+            SampleSeparators(sample);
+            BuildSkeleton(presplitSeparators_);
+            // resample for the next tree
+            presplitSeparators_.clear();
+        }
+
+        if (n == flushNode_)
+            flushReachedRoot_ = true;
 
+        // perform the switch, schedule root, add node to empty list
+        Buffer temp = root->buffer_;
+        root->buffer_ = n->buffer_;
         n->buffer_ = temp;
         temp.Clear();
+        pthread_mutex_unlock(&n->bufferMutex_);
+        pthread_mutex_unlock(&root->bufferMutex_);
+
+        root->schedule(EMPTY);
         AddEmptyRootNode(n);
     }
 
-    void CompressTree::StartThreads() {
+    void CompressTree::BuildRoot() {
         // create root node; initially a leaf
         rootNode_ = new Node(this, 0);
         rootNode_->separator_ = UINT32_MAX;
+        numLeaves_ = 1;
+
+        if (presplitLeaves_ > 0) {
+            if (presplitSeparators_.empty())
+                presplitPending_ = true;
+            else
+                BuildSkeleton(presplitSeparators_);
+        }
+    }
+
+    void CompressTree::StartThreads() {
+        BuildRoot();
 
         inputNode_ = new Node(this, 0);
         inputNode_->separator_ = UINT32_MAX;
+        inputNodes_.clear();
+        inputNodes_.push_back(inputNode_);
 
         uint32_t number_of_root_nodes = 4;
         for (uint32_t i = 0; i < number_of_root_nodes - 1; ++i) {
             Node* n = new Node(this, 0);
             n->separator_ = UINT32_MAX;
             emptyRootNodes_.push_back(n);
+            inputNodes_.push_back(n);
         }
 
         emptyType_ = IF_FULL;
@@ -348,29 +2203,115 @@ namespace gpucbt {
         emptier_->StartThreads(emptierThreadCount);
 
         pthread_barrier_wait(&threadsBarrier_);
+        pthread_mutex_lock(&inputMutex_);
         threadsStarted_ = true;
+        pthread_mutex_unlock(&inputMutex_);
+        UpdatePooledArrays();
     }
 
     void CompressTree::StopThreads() {
-        delete inputNode_;
-
         merger_->StopThreads();
         sorter_->StopThreads();
         emptier_->StopThreads();
         threadsStarted_ = false;
+
+        // all input nodes, not just the current one, so that the next
+        // StartThreads() doesn't find stale empty roots
+        pthread_mutex_lock(&emptyRootNodesMutex_);
+        emptyRootNodes_.clear();
+        pthread_mutex_unlock(&emptyRootNodesMutex_);
+        for (uint32_t i = 0; i < inputNodes_.size(); ++i) {
+            inputNodes_[i]->buffer_.Deallocate();
+            delete inputNodes_[i];
+        }
+        inputNodes_.clear();
+        inputNode_ = NULL;
+        // the pool is emptied once the last recycled tree stops
+        UpdatePooledArrays();
+    }
+
+    void CompressTree::UpdatePooledArrays() {
+        uint32_t num = 0;
+        if (recycle_ && threadsStarted_)
+            num = inputNodes_.size() + 1;
+        if (num > pooledArrays_)
+            Buffer::ReservePooled(num - pooledArrays_);
+        else if (num < pooledArrays_)
+            Buffer::ReleasePooled(pooledArrays_ - num);
+        pooledArrays_ = num;
     }
 
-    bool CompressTree::CreateNewRoot(Node* otherChild) {
+    bool CompressTree::CreateNewRoot(const std::vector<Node*>& otherChildren) {
         Node* newRoot = new Node(this, rootNode_->level() + 1);
         newRoot->separator_ = UINT32_MAX;
 #ifdef CT_NODE_DEBUG
-        fprintf(stderr, "Node %d is new root; children are %d and %d\n",
-                newRoot->id_, rootNode_->id_, otherChild->id_);
+        fprintf(stderr, "Node %d is new root; children are %d and %lu others\n",
+                newRoot->id_, rootNode_->id_, otherChildren.size());
 #endif
-        // add two children of new root
+        // add children of new root
         newRoot->AddChild(rootNode_);
-        newRoot->AddChild(otherChild);
+        if (!otherChildren.empty())
+            newRoot->AddChildren(otherChildren);
         rootNode_ = newRoot;
         return true;
     }
+
+    void CompressTree::SampleSeparators(const std::vector<uint32_t>& hashes) {
+        presplitSeparators_.clear();
+        uint32_t num = hashes.size();
+        for (uint32_t j = 1; j < presplitLeaves_ && num > 0; ++j) {
+            uint32_t sep = hashes[static_cast<uint64_t>(j) * num /
+                    presplitLeaves_];
+            if (sep == 0 || sep == UINT32_MAX)
+                continue;
+            if (presplitSeparators_.empty() ||
+                    sep > presplitSeparators_.back())
+                presplitSeparators_.push_back(sep);
+        }
+    }
+
+    void CompressTree::BuildSkeleton(const std::vector<uint32_t>& separators) {
+        if (separators.empty() || !rootNode_->isLeaf() ||
+                !rootNode_->buffer_.empty())
+            return;
+
+        // leaves; buffers are allocated when something is copied into them
+        std::vector<Node*> nodes;
+        for (uint32_t i = 0; i <= separators.size(); ++i) {
+            Node* l = new Node(this, 0);
+            l->separator_ = (i < separators.size()? separators[i] :
+                    UINT32_MAX);
+            l->buffer_.Deallocate();
+            nodes.push_back(l);
+        }
+
+        numLeaves_ = nodes.size();
+        BuildUpperLevels(nodes);
+        fprintf(stderr, "Pre-split tree into %lu leaves, depth %u\n",
+                separators.size() + 1, rootNode_->level_ + 1);
+    }
+
+    void CompressTree::BuildUpperLevels(std::vector<Node*>& nodes) {
+        uint32_t level = nodes.front()->level_;
+        while (nodes.size() > b_) {
+            ++level;
+            uint32_t num = nodes.size();
+            uint32_t k = (num + b_ - 1) / b_;
+            std::vector<Node*> parents;
+            for (uint32_t j = 0; j < k; ++j) {
+                Node* p = new Node(this, level);
+                for (uint32_t i = j * num / k; i < (j + 1) * num / k; ++i) {
+                    p->children_.push_back(nodes[i]);
+                    nodes[i]->parent_ = p;
+                }
+                p->separator_ = p->children_.back()->separator_;
+                p->UpdateSeparators();
+                p->buffer_.Deallocate();
+                parents.push_back(p);
+            }
+            nodes.swap(parents);
+        }
+        rootNode_->level_ = level + 1;
+        rootNode_->AddChildren(nodes);
+    }
 }
@@ -25,12 +25,16 @@
 #define SRC_COMPRESSTREE_H_
 
 #include <pthread.h>
+#include <sched.h>
 #include <deque>
 #include <queue>
+#include <string>
 #include <vector>
 #include "Config.h"
 #include "Node.h"
 #include "PartialAgg.h"
+#include "RunFile.h"
+#include "SegmentMerger.h"
 
 namespace gpucbt {
     enum EmptyType {
@@ -38,7 +42,83 @@ namespace gpucbt {
         IF_FULL
     };
 
+    enum EmptyMethod {
+        // sort and aggregate every buffer and split it by separator
+        SORT_AND_SPLIT,
+        // partition internal buffers to children unsorted; only leaves are
+        // sorted and aggregated
+        PARTITION
+    };
+
+    enum FinalizeMethod {
+        // empty every buffer down to the leaves; each leaf is read as soon
+        // as the flush has passed all of its ancestors
+        FLUSH_TO_LEAVES,
+        // leave pending buffers where they are and merge them with the
+        // leaves while reading
+        MERGE_ON_READ
+    };
+
+    /* Aggregates handed out by CompressTree::ReadSpan() */
+    struct MessageSpan {
+        const Message* messages;
+        uint32_t num;
+    };
+
+    /* Reads one hash-ordered partition of the aggregates handed out by
+     * CompressTree::PartitionedRead(). Iterators over different partitions
+     * can be used from different threads. */
+    class PartitionIterator {
+      public:
+        PartitionIterator();
+        /* Points span at up to max (all if 0) aggregates of the current
+         * leaf. Returns false at the end of the partition */
+        bool NextSpan(MessageSpan& span, uint32_t max = 0);
+        /* Returns false at the end of the partition */
+        bool Next(Message& msg);
+        /* Number of aggregates in the partition */
+        uint64_t size() const;
+
+      private:
+        friend class CompressTree;
+        std::vector<MessageSpan> spans_;
+        uint32_t curSpan_;
+        uint32_t curOffset_;
+        uint64_t size_;
+    };
+
+    /* All aggregates at the time CompressTree::TakeSnapshot() was called.
+     * The buffers of the tree are pinned rather than copied, and the
+     * aggregates are merged as they are read, which can be done from any
+     * thread while the tree keeps ingesting. Deleting the snapshot unpins
+     * the buffers. */
+    class Snapshot {
+      public:
+        ~Snapshot();
+        /* Returns false once all aggregates have been read */
+        bool Next(Message& msg);
+
+      private:
+        friend class CompressTree;
+        Snapshot();
+        Snapshot(const Snapshot&);
+        Snapshot& operator=(const Snapshot&);
+
+        std::vector<Message*> pinned_;
+        // messages that weren't sorted in the tree, sorted by the snapshot
+        std::vector<Message> unsorted_;
+        // runs of leaves kept on disk
+        std::vector<RunFile*> runs_;
+        SegmentMerger merge_;
+    };
+
+    /* Called by CompressTree::Scan() for every aggregate in the range */
+    typedef void (*ScanCallback)(const Message& msg, void* arg);
+
     class Node;
+    class HotKeyCache;
+    class HashAggregator;
+    class HyperLogLog;
     class Emptier;
     class Compressor;
     class Merger;
@@ -46,17 +126,141 @@ namespace gpucbt {
 
     class CompressTree {
       public:
-        CompressTree(uint32_t b, uint32_t buffer_size);
+        CompressTree(uint32_t b, uint32_t buffer_size,
+                EmptyMethod method = SORT_AND_SPLIT,
+                FinalizeMethod finalize = FLUSH_TO_LEAVES);
         ~CompressTree();
 
         /* Insert record into tree */
         bool insert(const Message& agg);
         bool bulk_insert(const Message* paos, uint64_t num);
+        /* Zero-copy insertion. A batch obtained from AllocateBatch() can hold
+         * up to MaxBatchSize() messages. Once filled, it is handed over using
+         * bulk_insert_owned() and the tree takes ownership of the array.
+         * A batch that isn't handed over is given back with FreeBatch(). */
+        static Message* AllocateBatch();
+        static void FreeBatch(Message* batch);
+        static uint32_t MaxBatchSize();
+        bool bulk_insert_owned(Message* batch, uint32_t num);
+        /* Load messages that are already sorted by hash into an empty tree.
+         * Adjacent duplicates are aggregated and leaves are built directly,
+         * without going through the root buffer; a hash with too many
+         * distinct keys for a full buffer is chained on as runs of its leaf,
+         * as for a full heavy-key leaf. The tree accepts regular inserts
+         * afterwards. Returns false, leaving the tree untouched, if the tree
+         * is not empty, the input is not sorted or a run can't be written. */
+        bool bulk_load_sorted(const Message* msgs, uint64_t num);
+        /* Merge messages that are already sorted by hash, such as partial
+         * aggregates from another tree, straight into the leaves: the part
+         * of the input in a leaf's range is appended to it as another
+         * sorted run, to be merged with the leaf rather than re-sorted.
+         * Leaves that are busy or full are waited for. An empty tree is
+         * bulk-loaded instead. Returns false, leaving the tree untouched,
+         * if the input is not sorted. */
+        bool MergeSorted(const Message* msgs, uint64_t num);
+        /* Read all aggregates of other, which is left empty, and merge
+         * them into this tree using MergeSorted() */
+        bool MergeFrom(CompressTree& other);
+        /* Non-blocking insert. Messages that can't be placed because no empty
+         * root buffer is available are moved into a bounded staging area,
+         * which is drained by later inserts. Returns false if the staging
+         * area fills up; num_inserted is the number of messages accepted. */
+        bool try_bulk_insert(const Message* msgs, uint64_t num,
+                uint64_t& num_inserted);
+        /* Time spent by the inserter blocked waiting for an empty root
+         * buffer. Bucket i counts stalls that took [2^i, 2^(i+1)) usecs. */
+        void GetStallHistogram(std::vector<uint64_t>& hist);
+        /* Build a balanced skeleton of num_leaves leaves up front instead of
+         * growing the tree through leaf splits during warm-up. Separators
+         * are the quantiles of histogram, whose buckets divide the hash
+         * space evenly; if it is empty, they are sampled from the first
+         * root buffer instead. Must be called before inserting. */
+        bool Presplit(uint32_t num_leaves,
+                const std::vector<uint64_t>& histogram =
+                        std::vector<uint64_t>());
+        /* Keep the leaf level on disk, in directory dir, once the tree has
+         * max_leaves leaves. Full leaves are no longer split then; their
+         * sorted and aggregated buffers are written out as runs covering
+         * the leaf's hash range, and the slaves merge a leaf's runs as they
+         * accumulate. Reads merge each leaf's runs as they go, so that the
+         * number of distinct keys is bounded by disk rather than memory.
+         * Must be called before inserting. Trees with a leaf tier can't be
+         * checkpointed. */
+        bool SetLeafTier(const char* dir, uint32_t max_leaves);
+        /* Run the slave threads on the given cpus only. Must be called
+         * before inserting */
+        bool SetAffinity(const std::vector<uint32_t>& cpus);
         /* read values */
         // returns true if there are more values to be read and false otherwise
         bool bulk_read(Message* pao_list, uint64_t& num_read, uint64_t max);
         bool nextValue(Message& msg);
+        /* Zero-copy read. Points span at up to max aggregates (the rest of
+         * the current leaf if max is 0) inside the tree's buffers. The
+         * buffers aren't freed or reused until the span is released with
+         * ReleaseSpan(); spans are released in the order they were handed
+         * out. With MERGE_ON_READ, or once leaves are kept on disk,
+         * aggregates are produced by a merge and staged in a buffer of the
+         * tree, so at most one span may be outstanding. Returns false,
+         * without a span, once all aggregates have been read. */
+        bool ReadSpan(MessageSpan& span, uint32_t max = 0);
+        void ReleaseSpan();
+        /* Flush and divide all aggregates into num_partitions partitions of
+         * about equal size, parts[i] preceding parts[i + 1] in hash order.
+         * Partitioned reads always flush to the leaves, whatever the
+         * FinalizeMethod, and can't be mixed with other reads. The tree is
+         * kept until EndPartitionedRead(), which empties it. */
+        bool PartitionedRead(uint32_t num_partitions,
+                std::vector<PartitionIterator>& parts);
+        void EndPartitionedRead();
+        /* Look up the current aggregate for msg's key without flushing.
+         * Pending buffers along the root-to-leaf path are probed, as well
+         * as input buffers not yet emptied into the tree. It can be called
+         * from any thread while inserts go on, but not during a read or
+         * Reset(). Only the buffer being probed is locked at a time, so the
+         * slaves keep working on the rest of the tree. */
+        bool Lookup(const Message& msg, Message& result);
+        /* Call callback, in hash order, with the current aggregate of every
+         * key whose hash is in [lo, hi); hi may be 2^32 to include the hash
+         * UINT32_MAX. Only subtrees overlapping the range are pinned, as by
+         * TakeSnapshot(), and their buffers are merged where they are
+         * without flushing. The callbacks are made once all locks have been
+         * let go of. Returns the number of aggregates. Same threading rules
+         * as TakeSnapshot(). */
+        uint64_t Scan(uint32_t lo, uint64_t hi, ScanCallback callback,
+                void* arg);
+        /* Take a consistent snapshot of all aggregates without flushing.
+         * Buffers are pinned with the locks Lookup() takes, each holding up
+         * only the slave working on it, and inserts are only held up while
+         * the input buffers are pinned. It can be called from any thread
+         * while inserts go on, but not during a read or Reset(). The caller
+         * deletes the snapshot. */
+        Snapshot* TakeSnapshot();
+        /* Write the shape of the tree and every buffer and run, as they
+         * are, to path, in blocks with checksums. The buffers are pinned as
+         * by TakeSnapshot() and written out once all locks have been let
+         * go of. The previous file at path is replaced only once the new
+         * one is complete. Same threading rules as TakeSnapshot(). */
+        bool Checkpoint(const char* path);
+        /* Load a checkpoint into a tree that hasn't been inserted into.
+         * Buffers are restored from the mapped file as they were, sorted or
+         * not, so nothing is re-sorted; messages that hadn't reached the
+         * tree when the checkpoint was taken are inserted again. Returns
+         * false, leaving the tree untouched, if the file can't be read, is
+         * corrupt or was written by a tree with another b or EmptyMethod. */
+        bool Restore(const char* path);
         void clear();
+        /* Keep the slave threads, buffer memory and, if keep_skeleton is
+         * set, the shape of the tree when a read finishes, so that the next
+         * aggregation cycle doesn't start from a cold tree. Freed buffer
+         * arrays are kept for reuse, as many as the tree has input and
+         * root buffers, until recycling is turned off or the tree stops */
+        void SetRecycle(bool recycle, bool keep_skeleton = false);
+        /* Discard all aggregates and start a new cycle, keeping the slave
+         * threads. With keep_skeleton, every node stays in place with an
+         * empty buffer; otherwise the tree shrinks back to a single leaf. */
+        void Reset(bool keep_skeleton = false);
+        /* Number of completed Reset()s */
+        uint64_t epoch() const;
 
       private:
         friend class Node;
@@ -68,41 +272,269 @@ namespace gpucbt {
 #ifdef ENABLE_COUNTERS
         friend class Monitor;
 #endif
-        Node* GetEmptyRootNode();
+        /* Copy messages into input node(s), swapping them as they fill up.
+         * If block is false, stops instead of waiting for an empty root
+         * node. Returns the number of messages copied. */
+        uint64_t InsertIntoInputNode(const Message* msgs, uint64_t num,
+                bool block);
+        /* Copy num messages, which have to fit, into the input node through
+         * the hot-key cache. Called with inputMutex_ held */
+        void FillInputNode(const Message* msgs, uint32_t num);
+        /* Schedule the full input node for sorting and replace it with an
+         * empty root node. If block is false and there are no empty root
+         * nodes, returns false and leaves the input node unchanged. */
+        bool SwapInputNode(bool block = true);
+        /* Copy as many messages as fit into the staging area. Returns the
+         * number of messages copied. Called with inputMutex_ held */
+        uint64_t Stage(const Message* msgs, uint64_t num);
+        /* Move staged messages into the input node. Returns true if the
+         * staging area is empty afterwards. */
+        bool DrainStaged(bool block);
+#ifdef ENABLE_HASH_AGGREGATION
+        /* Aggregate messages in the hash table. Returns the number of
+         * messages consumed, which is less than num if the distinct key
+         * estimate crossed kHashAggregationLimit and the tree took over.
+         * block is passed on to SwitchToTreeMode(). */
+        uint64_t HashAggregate(const Message* msgs, uint64_t num,
+                bool block);
+        /* Move the contents of the hash table into the tree. If block is
+         * false, whatever doesn't fit into the input nodes is staged. */
+        void SwitchToTreeMode(bool block);
+        bool NextHashValue(Message& msg);
+        void ResetHashMode();
+#endif  // ENABLE_HASH_AGGREGATION
+        Node* GetEmptyRootNode(bool block = true);
         void AddEmptyRootNode(Node* n);
         void SubmitNodeForEmptying(Node* n);
         bool RootNodeAvailable();
-        bool AddLeafToEmpty(Node* node);
-        bool CreateNewRoot(Node* otherChild);
+        bool CreateNewRoot(const std::vector<Node*>& otherChildren);
+        /* Separators splitting the sorted hashes evenly into
+         * presplitLeaves_ leaves */
+        void SampleSeparators(const std::vector<uint32_t>& hashes);
+        /* Turn the empty root leaf into the root of a balanced tree whose
+         * leaves are bounded by separators */
+        void BuildSkeleton(const std::vector<uint32_t>& separators);
+        /* Group the nodes of a level, left to right, b at a time into
+         * internal levels and hang the top level under the empty root leaf */
+        void BuildUpperLevels(std::vector<Node*>& nodes);
+        /* A buffer pinned by PinAll(), along with what is needed to
+         * restore its node */
+        struct PinnedNode {
+            // index of the parent's entry; UINT32_MAX for the root
+            uint32_t parent;
+            uint32_t level;
+            uint32_t separator;
+            bool heavy;
+            // the first num messages, shared with the buffer; NULL if the
+            // buffer is empty
+            Message* messages;
+            uint32_t num;
+            // copy of the unsorted messages after the buffer's runs, which
+            // are still being sorted into runs
+            std::vector<Message> tail;
+            std::vector<uint32_t> runs;
+            bool sorted;
+            bool summarized;
+            // referenced until the caller is done with them
+            std::vector<RunFile*> runFiles;
+        };
+        /* Lock the root's buffer and then inputMutex_, the order in which
+         * messages leave them, so that none moves between the input side
+         * and the tree. Returns the root, or NULL with only inputMutex_
+         * locked if the threads haven't been started. Called with treeLock_
+         * held shared */
+        Node* LockInput();
+        /* Pin every message of the tree with a hash in [lo, hi) where it
+         * is. Messages that haven't reached an input buffer are copied to
+         * pending, input buffers are pinned into inputs and the buffers of
+         * the tree that overlap the range into nodes, parents before
+         * children. Pinned buffers aren't cut down to the range. Only the
+         * path to the buffer being pinned is locked at a time */
+        void PinAll(std::vector<Message>& pending,
+                std::vector<PinnedNode>& inputs,
+                std::vector<PinnedNode>& nodes, uint32_t lo, uint64_t hi);
+        /* Pin n's buffer and those below it that overlap [lo, hi) into
+         * nodes. Called with n's buffer locked, which is unlocked once the
+         * subtree is done; each child is locked before it is visited, so
+         * no message can leave the subtree or move within it unseen */
+        void PinSubtree(Node* n, uint32_t parent,
+                std::vector<PinnedNode>& nodes, uint32_t lo, uint64_t hi);
+        /* Pin n's buffer and runs into pinned. Called with the buffer
+         * locked */
+        void PinNode(Node* n, uint32_t parent, PinnedNode& pinned);
+        /* Snapshot of the aggregates with hashes in [lo, hi) */
+        Snapshot* SnapshotRange(uint32_t lo, uint64_t hi);
+        /* Hand a pinned buffer over to snap: the parts of sorted segments
+         * in [lo, hi) are merged where they are, others are added to
+         * unsorted to be copied */
+        void AddToSnapshot(PinnedNode& pinned, Snapshot* snap,
+                std::vector<MessageSpan>& unsorted, uint32_t lo,
+                uint64_t hi);
         void EmptyTree();
+        /* Create the root leaf, pre-split if that was requested */
+        void BuildRoot();
+        /* Free every node of the tree */
+        void DeleteNodes();
+        /* Reset read and flush state once the tree has been emptied */
+        void ResetState();
+        /* Block until every scheduled action has been performed */
+        void WaitForSlaves();
+        /* Called by Node::schedule() and by the slaves once an action has
+         * been performed, including any scheduling it led to */
+        void ActionScheduled();
+        void ActionPerformed();
+        /* Start flushing and position the read cursor at the first
+         * non-empty leaf, without waiting for the rest of the flush */
+        void StartLeafRead();
+        /* Move the read cursor to the next non-empty leaf, waiting for it
+         * to become final. Returns false after the last leaf */
+        bool NextLeaf();
+        Node* WaitForFinalLeaf(uint32_t hash);
+        /* Set up readMerge_ over the runs and the buffer of a leaf that
+         * has runs on disk */
+        void MergeLeafRuns(Node* leaf);
+        /* true once everything in readLeaf_ has been read */
+        bool LeafDone() const;
+        /* Whether the full leaf should write its buffer out as a run
+         * rather than be split. Called by the slaves with treeLock_ held */
+        bool ShouldWriteRun(Node* leaf);
+        /* The leaf covering hash if the flush has passed every node on the
+         * way to it, NULL otherwise. Called with treeLock_ held */
+        Node* FinalLeaf(uint32_t hash);
+        /* Called once all aggregates have been read: empties the tree, or
+         * leaves that to the release of the last pinned span */
+        void FinishRead();
+        /* Move staged messages and cached hot keys into the input node */
+        void DrainIntoInputNode();
         /* Write out all buffers to leaves. Do this before reading */
         bool FlushBuffers();
-        void HandleFullLeaves();
+        /* Used instead of FlushBuffers() by MERGE_ON_READ: wait for the
+         * slaves to settle and set up a k-way merge over the sorted
+         * segments of every non-empty buffer in the tree */
+        bool MergeBuffers();
+        bool NextMergedValue(Message& msg);
         void StartThreads();
         void StopThreads();
+        /* Bring the arrays reserved in Buffer's pool in line with
+         * recycle_ and the threads being started */
+        void UpdatePooledArrays();
 
       private:
         // (a,b)-tree...
         const uint32_t b_;
+        const EmptyMethod emptyMethod_;
+        const FinalizeMethod finalizeMethod_;
         uint32_t nodeCtr;
         Node* rootNode_;
         Node* inputNode_;
+        // all nodes that take turns as the input node
+        std::vector<Node*> inputNodes_;
+        /* Held shared by the slaves while they perform an action and by
+         * the readers that don't flush, and exclusively while the shape of
+         * the tree changes: when nodes are split, runs are chained on to
+         * leaves or the tree is built by hand */
+        pthread_rwlock_t treeLock_;
+        /* Held by the inserter while it moves messages into the hash
+         * table, the hot-key cache, the staging area or the input node, and
+         * by the readers that don't flush while they look at those and at
+         * the input nodes */
+        pthread_mutex_t inputMutex_;
+        /* Broadcast whenever a node has been emptied, which may have made
+         * leaves final while a flush is read */
+        pthread_mutex_t flushProgressMutex_;
+        pthread_cond_t flushProgress_;
+        // last input node submitted by the streaming flush
+        Node* flushNode_;
+        bool flushReachedRoot_;
+        /* Actions scheduled on nodes and not yet performed. Work only
+         * moves between the slaves while an action is performed, so the
+         * slaves are idle once this drops to 0 */
+        uint64_t pendingActions_;
+        pthread_mutex_t pendingActionsMutex_;
+        pthread_cond_t actionsDone_;
 
         std::deque<Node*> emptyRootNodes_;
         pthread_mutex_t emptyRootNodesMutex_;
 
         pthread_cond_t emptyRootAvailable_;
 
+        /* Backpressure-related */
+        static const uint32_t kMaxStagedMessages;
+        static const uint32_t kStallHistogramBuckets = 32;
+        Message* staged_;
+        uint32_t numStaged_;
+        // emptyRootNodesMutex_ protection begin
+        uint64_t stallHistogram_[kStallHistogramBuckets];
+        uint64_t numWouldBlock_;
+        // emptyRootNodesMutex_ protection end
+
         bool allFlush_;
         EmptyType emptyType_;
-        std::deque<Node*> leavesToBeEmptied_;
+        // number of leaves found to hold a single heavy-hitter hash
+        uint64_t numHeavyLeaves_;
+        // number of leaves in the tree; changed along with its shape
+        uint32_t numLeaves_;
         std::vector<Node*> allLeaves_;
-        uint32_t lastLeafRead_;
+        // leaf being read while the flush streams out leaves
+        Node* readLeaf_;
         uint32_t lastOffset_;
         uint32_t lastElement_;
+        // spans handed out by ReadSpan() and not yet released
+        static const uint32_t kMergeSpanSize;
+        uint32_t pinnedSpans_;
+        bool readFinished_;
+        std::vector<Message> spanMessages_;
+
+        /* Recycling across aggregation cycles */
+        bool recycle_;
+        bool keepSkeleton_;
+        // arrays reserved in Buffer's pool, one per input and root buffer
+        // while a recycled tree has its threads running
+        uint32_t pooledArrays_;
+        uint64_t epoch_;
+
+        /* Read-time merge */
+        SegmentMerger readMerge_;
+
+#ifdef ENABLE_HASH_AGGREGATION
+        /* Hash aggregation until the number of distinct keys gets large */
+        static const uint32_t kHashAggregationLimit;
+        static const uint32_t kCardinalityCheckInterval;
+        bool hashMode_;
+        HashAggregator* hashAgg_;
+        HyperLogLog* cardinality_;
+        uint64_t numHashAggregated_;
+#endif
+
+#ifdef ENABLE_HOTKEY_CACHE
+        /* Pre-aggregation of hot keys before the input buffer */
+        HotKeyCache* hotKeys_;
+#endif
+
+        /* One past the largest hash, for the end of a range */
+        static const uint64_t kNumHashes;
+
+        /* Checkpointing */
+        static const uint32_t kCheckpointMagic;
+        static const uint32_t kCheckpointVersion;
+
+        /* Pre-splitting */
+        static const uint32_t kPresplitSampleSize;
+        uint32_t presplitLeaves_;
+        // set if separators are to be sampled from the first root buffer;
+        // only changed while the slaves are idle or by the sorter
+        bool presplitPending_;
+        std::vector<uint32_t> presplitSeparators_;
+
+        /* Leaf tier on disk; runDir_ is empty if there is none */
+        std::string runDir_;
+        uint32_t maxMemoryLeaves_;
 
         /* Slave-threads */
         bool threadsStarted_;
+        // set if the slaves are restricted to affinity_
+        bool pinThreads_;
+        cpu_set_t affinity_;
         pthread_barrier_t threadsBarrier_;
 
         /* Eviction-related */
@@ -6,5 +6,7 @@
 //#define ENABLE_INTEGRITY_CHECK
 //#define ENABLE_COUNTERS
 #define ENABLE_PAGING
+//#define ENABLE_HOTKEY_CACHE
+//#define ENABLE_HASH_AGGREGATION
 
 #endif // CTCONFIG_H
@@ -0,0 +1,104 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <string.h>
+#include <algorithm>
+#include "HashAggregator.h"
+
+namespace gpucbt {
+    HashAggregator::HashAggregator(uint32_t max_keys) :
+            maxKeys_(max_keys),
+            numSlots_(1),
+            numKeys_(0) {
+        // keep the load factor at or below 0.5
+        while (numSlots_ < 2 * maxKeys_)
+            numSlots_ <<= 1;
+        slots_ = new Message[numSlots_];
+        occupied_ = new bool[numSlots_];
+        memset(occupied_, 0, numSlots_ * sizeof(bool));
+    }
+
+    HashAggregator::~HashAggregator() {
+        delete[] slots_;
+        delete[] occupied_;
+    }
+
+    bool HashAggregator::Insert(const Message& msg) {
+        uint32_t ind = msg.hash() & (numSlots_ - 1);
+        while (occupied_[ind]) {
+            if (slots_[ind].hash() == msg.hash() && slots_[ind].SameKey(msg)) {
+                slots_[ind].Merge(msg);
+                return true;
+            }
+            ind = (ind + 1) & (numSlots_ - 1);
+        }
+        if (numKeys_ >= maxKeys_)
+            return false;
+        slots_[ind] = msg;
+        occupied_[ind] = true;
+        numKeys_++;
+        return true;
+    }
+
+    bool HashAggregator::Lookup(const Message& msg, Message& result) const {
+        uint32_t ind = msg.hash() & (numSlots_ - 1);
+        while (occupied_[ind]) {
+            if (slots_[ind].hash() == msg.hash() && slots_[ind].SameKey(msg)) {
+                result = slots_[ind];
+                return true;
+            }
+            ind = (ind + 1) & (numSlots_ - 1);
+        }
+        return false;
+    }
+
+    void HashAggregator::CopyRange(uint32_t lo, uint64_t hi,
+            std::vector<Message>& out) const {
+        for (uint32_t i = 0; i < numSlots_; ++i) {
+            if (occupied_[i] && slots_[i].hash() >= lo &&
+                    slots_[i].hash() < hi)
+                out.push_back(slots_[i]);
+        }
+    }
+
+    void HashAggregator::Finalize() {
+        uint32_t out = 0;
+        for (uint32_t i = 0; i < numSlots_; ++i) {
+            if (occupied_[i]) {
+                occupied_[i] = false;
+                slots_[out++] = slots_[i];
+            }
+        }
+        std::sort(slots_, slots_ + out);
+    }
+
+    const Message* HashAggregator::messages() const {
+        return slots_;
+    }
+
+    uint32_t HashAggregator::size() const {
+        return numKeys_;
+    }
+
+    void HashAggregator::Clear() {
+        memset(occupied_, 0, numSlots_ * sizeof(bool));
+        numKeys_ = 0;
+    }
+}
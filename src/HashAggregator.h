@@ -0,0 +1,62 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef SRC_HASHAGGREGATOR_H_
+#define SRC_HASHAGGREGATOR_H_
+#include <stdint.h>
+#include <vector>
+#include "Message.h"
+
+namespace gpucbt {
+    /* In-memory hash aggregation of messages: an open-addressing table
+     * (linear probing on hash()) in which messages with the same key are
+     * merged. Used instead of the tree while the number of distinct keys is
+     * small. */
+    class HashAggregator {
+      public:
+        explicit HashAggregator(uint32_t max_keys);
+        ~HashAggregator();
+
+        /* Merge msg into the table. Returns false, without inserting, if
+         * the table already holds max_keys distinct keys. */
+        bool Insert(const Message& msg);
+        bool Lookup(const Message& msg, Message& result) const;
+        /* Append the aggregates with hashes in [lo, hi) to out */
+        void CopyRange(uint32_t lo, uint64_t hi,
+                std::vector<Message>& out) const;
+        /* Move all aggregates to the front of the table, sorted by hash.
+         * They can then be read using messages(). No inserts are allowed
+         * until Clear() is called. */
+        void Finalize();
+        const Message* messages() const;
+        uint32_t size() const;
+        void Clear();
+
+      private:
+        const uint32_t maxKeys_;
+        uint32_t numSlots_;
+
+        Message* slots_;
+        bool* occupied_;
+        uint32_t numKeys_;
+    };
+}
+
+#endif  // SRC_HASHAGGREGATOR_H_
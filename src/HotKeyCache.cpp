@@ -0,0 +1,106 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <string.h>
+#include "HotKeyCache.h"
+
+namespace gpucbt {
+    // 4096 * 32B messages: fits comfortably in L2
+    const uint32_t HotKeyCache::kNumSlots = 4096;
+
+    HotKeyCache::HotKeyCache() :
+            numOccupied_(0),
+            drainIndex_(0),
+            hits_(0),
+            evictions_(0) {
+        slots_ = new Message[kNumSlots];
+        occupied_ = new bool[kNumSlots];
+        memset(occupied_, 0, kNumSlots * sizeof(bool));
+    }
+
+    HotKeyCache::~HotKeyCache() {
+        delete[] slots_;
+        delete[] occupied_;
+    }
+
+    bool HotKeyCache::Insert(const Message& msg, Message& evicted) {
+        uint32_t ind = msg.hash() & (kNumSlots - 1);
+        Message& slot = slots_[ind];
+        if (!occupied_[ind]) {
+            slot = msg;
+            occupied_[ind] = true;
+            numOccupied_++;
+            return false;
+        }
+        if (slot.hash() == msg.hash() && slot.SameKey(msg)) {
+            slot.Merge(msg);
+            hits_++;
+            return false;
+        }
+        evicted = slot;
+        slot = msg;
+        evictions_++;
+        return true;
+    }
+
+    bool HotKeyCache::Lookup(const Message& msg, Message& result) const {
+        uint32_t ind = msg.hash() & (kNumSlots - 1);
+        if (occupied_[ind] && slots_[ind].hash() == msg.hash() &&
+                slots_[ind].SameKey(msg)) {
+            result = slots_[ind];
+            return true;
+        }
+        return false;
+    }
+
+    void HotKeyCache::CopyRange(uint32_t lo, uint64_t hi,
+            std::vector<Message>& out) const {
+        for (uint32_t i = 0; i < kNumSlots; ++i) {
+            if (occupied_[i] && slots_[i].hash() >= lo &&
+                    slots_[i].hash() < hi)
+                out.push_back(slots_[i]);
+        }
+    }
+
+    bool HotKeyCache::Drain(Message& msg) {
+        for ( ; drainIndex_ < kNumSlots; ++drainIndex_) {
+            if (occupied_[drainIndex_]) {
+                msg = slots_[drainIndex_];
+                occupied_[drainIndex_] = false;
+                numOccupied_--;
+                return true;
+            }
+        }
+        drainIndex_ = 0;
+        return false;
+    }
+
+    bool HotKeyCache::empty() const {
+        return (numOccupied_ == 0);
+    }
+
+    uint64_t HotKeyCache::hits() const {
+        return hits_;
+    }
+
+    uint64_t HotKeyCache::evictions() const {
+        return evictions_;
+    }
+}
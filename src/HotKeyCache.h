@@ -0,0 +1,67 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef SRC_HOTKEYCACHE_H_
+#define SRC_HOTKEYCACHE_H_
+#include <stdint.h>
+#include "Config.h"
+#include <vector>
+#include "Message.h"
+
+namespace gpucbt {
+    /* Small direct-mapped table of messages that sits in front of the input
+     * buffer. Messages with a key already present in their slot are merged
+     * in place, so repeats of hot keys never reach the root buffer. A
+     * conflicting message evicts the slot's occupant. */
+    class HotKeyCache {
+      public:
+        HotKeyCache();
+        ~HotKeyCache();
+
+        /* Merge msg into the cache. Returns true if a message was evicted
+         * to make space, in which case it is copied into evicted. */
+        bool Insert(const Message& msg, Message& evicted);
+        /* Look up the cached aggregate for msg's key */
+        bool Lookup(const Message& msg, Message& result) const;
+        /* Append the cached messages with hashes in [lo, hi) to out */
+        void CopyRange(uint32_t lo, uint64_t hi,
+                std::vector<Message>& out) const;
+        /* Remove and return the next cached message. Returns false once the
+         * cache is empty. */
+        bool Drain(Message& msg);
+        bool empty() const;
+
+        uint64_t hits() const;
+        uint64_t evictions() const;
+
+      private:
+        static const uint32_t kNumSlots;
+
+        Message* slots_;
+        bool* occupied_;
+        uint32_t numOccupied_;
+        uint32_t drainIndex_;
+
+        uint64_t hits_;
+        uint64_t evictions_;
+    };
+}
+
+#endif  // SRC_HOTKEYCACHE_H_
@@ -0,0 +1,76 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <math.h>
+#include <string.h>
+#include "HashUtil.h"
+#include "HyperLogLog.h"
+
+namespace gpucbt {
+    HyperLogLog::HyperLogLog() {
+        registers_ = new uint8_t[kNumRegisters];
+        Clear();
+    }
+
+    HyperLogLog::~HyperLogLog() {
+        delete[] registers_;
+    }
+
+    void HyperLogLog::Add(uint32_t hash) {
+        // user-supplied hashes aren't necessarily well-mixed
+        uint32_t h = HashUtil::hashint_full_avalanche_1(hash);
+        uint32_t ind = h >> (32 - kPrecision);
+        // rank of the first set bit in the remaining bits
+        uint32_t w = h << kPrecision;
+        uint8_t rank = 1;
+        while (rank <= 32 - kPrecision && !(w & 0x80000000)) {
+            w <<= 1;
+            rank++;
+        }
+        if (rank > registers_[ind])
+            registers_[ind] = rank;
+    }
+
+    uint64_t HyperLogLog::Estimate() const {
+        double sum = 0;
+        uint32_t zeros = 0;
+        for (uint32_t i = 0; i < kNumRegisters; ++i) {
+            sum += 1.0 / (1ULL << registers_[i]);
+            if (registers_[i] == 0)
+                zeros++;
+        }
+        double m = kNumRegisters;
+        double alpha = 0.7213 / (1 + 1.079 / m);
+        double est = alpha * m * m / sum;
+
+        // small-range correction: linear counting
+        if (est <= 2.5 * m && zeros > 0)
+            est = m * log(m / zeros);
+        // large-range correction for 32-bit hashes
+        double two32 = 4294967296.0;
+        if (est > two32 / 30)
+            est = -two32 * log(1 - est / two32);
+        return static_cast<uint64_t>(est);
+    }
+
+    void HyperLogLog::Clear() {
+        memset(registers_, 0, kNumRegisters);
+    }
+}
@@ -0,0 +1,44 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef SRC_HYPERLOGLOG_H_
+#define SRC_HYPERLOGLOG_H_
+#include <stdint.h>
+
+namespace gpucbt {
+    /* Online estimate of the number of distinct hash values seen, using
+     * 2^kPrecision one-byte registers (relative error ~1.6%). */
+    class HyperLogLog {
+      public:
+        HyperLogLog();
+        ~HyperLogLog();
+        void Add(uint32_t hash);
+        uint64_t Estimate() const;
+        void Clear();
+
+      private:
+        static const uint32_t kPrecision = 12;
+        static const uint32_t kNumRegisters = 1 << kPrecision;
+
+        uint8_t* registers_;
+    };
+}
+
+#endif  // SRC_HYPERLOGLOG_H_
@@ -22,26 +22,44 @@
 // Author: Hrishikesh Amur
 
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <fcntl.h>
 #include <pthread.h>
+#define __STDC_LIMIT_MACROS /* for UINT32_MAX etc. */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <algorithm>
 #include <queue>
 #include <vector>
 
 #include "CompressTree.h"
 #include "HashUtil.h"
 #include "Node.h"
+#include "RunFile.h"
 #include "Slaves.h"
 
 namespace gpucbt {
+    // 16 messages = 512 bytes per child
+    const uint32_t Node::kWriteCombineSize = 16;
+    // 4 x uint32_t per 128-bit SSE register
+    const uint32_t Node::kSeparatorsPerVector = 4;
+    const uint32_t Node::kRunsPerMerge = 4;
+
     Node::Node(CompressTree* tree, uint32_t level) :
             tree_(tree),
             level_(level),
             parent_(NULL),
+            separators_(NULL),
+            separatorsCapacity_(0),
+            staged_(NULL),
+            stagedCapacity_(0),
+            heavy_(false),
             queueStatus_(NONE) {
         id_ = tree_->nodeCtr++;
         buffer_.SetParent(this);
@@ -56,6 +74,7 @@ namespace gpucbt {
         pthread_cond_init(&xgressCond_, NULL);
 
         pthread_spin_init(&queueStatusLock_, PTHREAD_PROCESS_PRIVATE);
+        pthread_mutex_init(&bufferMutex_, NULL);
     }
 
     Node::~Node() {
@@ -65,13 +84,28 @@ namespace gpucbt {
         pthread_mutex_destroy(&xgressMutex_);
         pthread_cond_destroy(&xgressCond_);
 
+        pthread_mutex_destroy(&bufferMutex_);
+        free(separators_);
+        delete[] staged_;
+        for (uint32_t i = 0; i < runFiles_.size(); ++i)
+            runFiles_[i]->Unref();
     }
 
     bool Node::insert(const Message& msg) {
         // copy into Buffer fields
         uint32_t n = buffer_.num_elements();
+        buffer_.PrepareWrite(n);
         buffer_.messages_[n] = msg;
         buffer_.set_num_elements(n + 1);
+        if (tree_->emptyMethod_ == SORT_AND_SPLIT)
+            buffer_.GenerateRuns();
+        return true;
+    }
+
+    bool Node::insert(const Message* msgs, uint32_t num) {
+        buffer_.Append(msgs, num);
+        if (tree_->emptyMethod_ == SORT_AND_SPLIT)
+            buffer_.GenerateRuns();
         return true;
     }
 
@@ -105,18 +139,13 @@ namespace gpucbt {
         uint32_t curElement = 0;
         uint32_t lastElement = 0;
 
-        /* if i am a leaf node, queue up for action later after all the
-         * internal nodes have been processed */
+        /* if i am a leaf node, perform() splits it if necessary */
         if (isLeaf()) {
-            /* this may be called even when buffer is not full (when flushing
-             * all buffers at the end). */
-            if (isFull() || isRoot()) {
-                tree_->AddLeafToEmpty(this);
-#ifdef CT_NODE_DEBUG
-                fprintf(stderr, "Leaf node %d added to full-leaf-list\
-                        %u/%u\n", id_, buffer_.num_elements(),
-                        Buffer::kEmptyThreshold);
-#endif
+            // when partitioning, the root buffer reaches a root leaf
+            // unsorted
+            if (isRoot() && tree_->emptyMethod_ == PARTITION) {
+                sortBuffer();
+                aggregateSortedBuffer();
             }
             return true;
         }
@@ -125,10 +154,12 @@ namespace gpucbt {
             for (curChild = 0; curChild < children_.size(); curChild++) {
                 children_[curChild]->EmptyIfNecessary();
             }
+        } else if (tree_->emptyMethod_ == PARTITION) {
+            partitionBuffer();
         } else {
             // find the first separator strictly greater than the first element
             while (buffer_.messages_[curElement].hash() >=
-                    children_[curChild]->separator_) {
+                    separators_[curChild]) {
                 children_[curChild]->EmptyIfNecessary();
                 curChild++;
 #ifdef ENABLE_ASSERT_CHECKS
@@ -151,14 +182,17 @@ namespace gpucbt {
 
             while (curElement < num) {
                 if (buffer_.messages_[curElement].hash() >=
-                        children_[curChild]->separator_) {
+                        separators_[curChild]) {
                     /* this separator is the largest separator that is not greater
                      * than *curHash. This invariant needs to be maintained.
                      */
                     if (curElement > lastElement) {
                         // copy elements into child
-                        CopyFromBuffer(children_[curChild]->buffer_,
-                                lastElement, curElement - lastElement);
+                        Node* c = children_[curChild];
+                        pthread_mutex_lock(&c->bufferMutex_);
+                        CopyFromBuffer(c->buffer_, lastElement,
+                                curElement - lastElement);
+                        pthread_mutex_unlock(&c->bufferMutex_);
 #ifdef CT_NODE_DEBUG
                         fprintf(stderr, "Copied %u elements into node %d\n",
                                 curElement - lastElement,
@@ -168,7 +202,7 @@ namespace gpucbt {
                     }
                     // skip past all separators not greater than current hash
                     while (buffer_.messages_[curElement].hash() >=
-                            children_[curChild]->separator_) {
+                            separators_[curChild]) {
                         children_[curChild]->EmptyIfNecessary();
                         curChild++;
 #ifdef ENABLE_ASSERT_CHECKS
@@ -185,8 +219,11 @@ namespace gpucbt {
             // copy remaining elements into child
             if (curElement >= lastElement) {
                 // copy elements into child
-                CopyFromBuffer(children_[curChild]->buffer_,
-                        lastElement, curElement - lastElement);
+                Node* c = children_[curChild];
+                pthread_mutex_lock(&c->bufferMutex_);
+                CopyFromBuffer(c->buffer_, lastElement,
+                        curElement - lastElement);
+                pthread_mutex_unlock(&c->bufferMutex_);
 #ifdef CT_NODE_DEBUG
                 fprintf(stderr, "Copied %u elements into node %d\n",
                         curElement - lastElement,
@@ -207,13 +244,58 @@ namespace gpucbt {
             else
                 buffer_.SetEmpty();
         }
-        // Split leaves can cause the number of children to increase. Check.
-        if (children_.size() > tree_->b_) {
-            SplitNonLeaf();
-        }
         return true;
     }
 
+    void Node::partitionBuffer() {
+        uint32_t num_children = children_.size();
+        // the staging area outlives the call; it only grows if splits have
+        // added children since the last partition
+        if (num_children > stagedCapacity_) {
+            delete[] staged_;
+            stagedCapacity_ = std::max(num_children, tree_->b_);
+            staged_ = new Message[stagedCapacity_ * kWriteCombineSize];
+        }
+        std::vector<uint32_t> num_staged(num_children, 0);
+        uint32_t num = buffer_.num_elements();
+        for (uint32_t i = 0; i < num; ++i) {
+            const Message& msg = buffer_.messages_[i];
+            uint32_t c = findChild(msg.hash());
+#ifdef ENABLE_ASSERT_CHECKS
+            if (c >= num_children) {
+                fprintf(stderr, "Node: %d: Can't place %u among children\n",
+                        id_, msg.hash());
+                assert(false);
+            }
+#endif
+            Message* wc = &staged_[c * kWriteCombineSize];
+            wc[num_staged[c]++] = msg;
+            if (num_staged[c] == kWriteCombineSize) {
+                Node* child = children_[c];
+                pthread_mutex_lock(&child->bufferMutex_);
+                child->buffer_.Append(wc, kWriteCombineSize);
+                pthread_mutex_unlock(&child->bufferMutex_);
+                num_staged[c] = 0;
+            }
+        }
+        for (uint32_t c = 0; c < num_children; ++c) {
+            Node* child = children_[c];
+            if (num_staged[c] > 0) {
+                pthread_mutex_lock(&child->bufferMutex_);
+                child->buffer_.Append(&staged_[c * kWriteCombineSize],
+                        num_staged[c]);
+                pthread_mutex_unlock(&child->bufferMutex_);
+            }
+            child->EmptyIfNecessary();
+        }
+
+        // set buffer as empty
+        if (!isRoot())
+            buffer_.Deallocate();
+        else
+            buffer_.SetEmpty();
+    }
+
     bool Node::sortBuffer() {
         bool ret = buffer_.Sort(/*use_gpu = */true);
         return ret;
@@ -224,97 +306,235 @@ namespace gpucbt {
         return ret;
     }
 
-    /* A leaf is split by moving half the elements of the buffer into a
-     * new leaf and inserting a median value as the separator element into the
-     * parent */
-    Node* Node::SplitLeaf() {
-        // select splitting index
+    /* A leaf is split in a single pass into leaves of about half the
+     * emptying threshold. Cuts are only made between different hashes, so a
+     * hash never straddles two leaves. A run of a single hash that is larger
+     * than the target (a heavy hitter, or a flood of collisions) is cut out
+     * into a heavy-key leaf of its own. Such a leaf holds one aggregated hash
+     * and can't be split; it shrinks through aggregation, and if it fills up
+     * all the same, perform() chains its buffer on as a run. A leaf that
+     * holds several hashes but less than twice the target, such as a root
+     * leaf on a flush, is still halved at a hash boundary. This leaf keeps
+     * the first piece in place; the rest are copied into new leaves which
+     * are added to the parent in one batch */
+    bool Node::SplitLeaf() {
         uint32_t num = buffer_.num_elements();
-        uint32_t splitIndex = num / 2;
-        while (buffer_.messages_[splitIndex].hash() ==
-                buffer_.messages_[splitIndex - 1].hash()) {
-            splitIndex++;
-#ifdef ENABLE_ASSERT_CHECKS
-            if (splitIndex == num) {
-                assert(false);
-            }
+        if (num == 0)
+            return false;
+        // the buffer is sorted, so a leaf holds a single hash iff its ends
+        // match; there is nothing to split
+        if (buffer_.messages_[0].hash() == buffer_.messages_[num - 1].hash()) {
+            if (!heavy_) {
+                heavy_ = true;
+                tree_->numHeavyLeaves_++;
+#ifdef CT_NODE_DEBUG
+                fprintf(stderr, "Node %d is a heavy-key leaf for %u\n", id_,
+                        buffer_.messages_[0].hash());
 #endif
+            }
+            // the root has to pass its buffer on all the same, so that an
+            // input buffer can take its place; it becomes the only child of
+            // a new root
+            if (isRoot())
+                tree_->CreateNewRoot(std::vector<Node*>());
+            return false;
+        }
+        if (heavy_) {
+            heavy_ = false;
+            tree_->numHeavyLeaves_--;
         }
 
-        // create new leaf
-        Node* newLeaf = new Node(tree_, 0);
-        CopyFromBuffer(newLeaf->buffer_, splitIndex,
-                num - splitIndex);
-        newLeaf->separator_ = separator_;
-
-        // modify this leaf properties
-
-        Buffer temp;
-        CopyFromBuffer(temp, 0, splitIndex);
-        separator_ = buffer_.messages_[splitIndex].hash();
-
-        // deallocate the old buffer
-        buffer_.Deallocate();
-
-        buffer_.messages_ = temp.messages_;
-        buffer_.set_num_elements(temp.num_elements());
-        // Clear temp to prevent automatic deallocation
-        temp.Clear();
+        // fill target of each resulting leaf
+        uint32_t target = Buffer::kEmptyThreshold / 2;
+
+        // cut points; cuts[0] is 0 and the final cut is num. heavy[j] is set
+        // if the piece starting at cuts[j] is a heavy-key run
+        std::vector<uint32_t> cuts;
+        std::vector<bool> heavy;
+        cuts.push_back(0);
+        heavy.push_back(false);
+        uint32_t runStart = 0;
+        for (uint32_t i = 1; i <= num; ++i) {
+            if (i < num && buffer_.messages_[i].hash() ==
+                    buffer_.messages_[i - 1].hash())
+                continue;
+            // [runStart, i) is a run of one hash
+            if (i - runStart > target) {
+                if (runStart > cuts.back()) {
+                    cuts.push_back(runStart);
+                    heavy.push_back(true);
+                } else {
+                    heavy.back() = true;
+                }
+                if (i < num) {
+                    cuts.push_back(i);
+                    heavy.push_back(false);
+                }
+            } else if (i - cuts.back() >= target && i < num) {
+                cuts.push_back(i);
+                heavy.push_back(false);
+            }
+            runStart = i;
+        }
+        if (cuts.size() < 2) {
+            // no piece reached the target; cut at the hash boundary nearest
+            // the middle, which exists as the ends differ
+            uint32_t i = num / 2;
+            while (i < num && buffer_.messages_[i].hash() ==
+                    buffer_.messages_[i - 1].hash())
+                ++i;
+            if (i == num) {
+                i = num / 2;
+                while (buffer_.messages_[i].hash() ==
+                        buffer_.messages_[i - 1].hash())
+                    --i;
+            }
+            cuts.push_back(i);
+            heavy.push_back(false);
+        }
+        cuts.push_back(num);
+
+        // create new leaves
+        std::vector<Node*> newLeaves;
+        for (uint32_t j = 1; j < cuts.size() - 1; ++j) {
+            Node* newLeaf = new Node(tree_, 0);
+            CopyFromBuffer(newLeaf->buffer_, cuts[j], cuts[j + 1] - cuts[j]);
+            newLeaf->separator_ = (j + 2 < cuts.size()?
+                    buffer_.messages_[cuts[j + 1]].hash() : separator_);
+            if (heavy[j]) {
+                newLeaf->heavy_ = true;
+                tree_->numHeavyLeaves_++;
+            }
+            newLeaves.push_back(newLeaf);
+        }
+        tree_->numLeaves_ += newLeaves.size();
+
+        // modify this leaf properties; the buffer keeps its capacity, so
+        // truncating it in place avoids copying the first piece
+        separator_ = buffer_.messages_[cuts[1]].hash();
+        buffer_.set_num_elements(cuts[1]);
+        if (heavy[0]) {
+            heavy_ = true;
+            tree_->numHeavyLeaves_++;
+        }
 
 #ifdef CT_NODE_DEBUG
-        fprintf(stderr, "Node %d splits to Node %d: new indices: %u and\
-                %u; new separators: %u and %u\n", id_, newLeaf->id_,
-                buffer_.num_elements(), newLeaf->buffer_.num_elements(),
-                separator_, newLeaf->separator_);
+        fprintf(stderr, "Node %d splits %lu ways: [%d: %u%s", id_,
+                cuts.size() - 1, id_, separator_, heavy_? " (heavy)" : "");
+        for (uint32_t j = 0; j < newLeaves.size(); ++j)
+            fprintf(stderr, ", %d: %u%s", newLeaves[j]->id_,
+                    newLeaves[j]->separator_,
+                    newLeaves[j]->heavy_? " (heavy)" : "");
+        fprintf(stderr, "]\n");
 #endif
 
         // if leaf is also the root, create new root
         if (isRoot()) {
-            tree_->CreateNewRoot(newLeaf);
+            tree_->CreateNewRoot(newLeaves);
         } else {
-            parent_->AddChild(newLeaf);
+            parent_->AddChildren(newLeaves);
         }
-        return newLeaf;
+        return true;
     }
 
     bool Node::CopyFromBuffer(Buffer& dest_buffer, uint32_t index,
             uint32_t num) {
-        uint32_t dest_num = dest_buffer.num_elements();
 #ifdef ENABLE_ASSERT_CHECKS
+        uint32_t dest_num = dest_buffer.num_elements();
         if (dest_num + num >= Buffer::kMaximumElements) {
             fprintf(stderr, "Node: %d, num_elements: %d, num_copied: %d\n",
                     id_, dest_num, num);
             assert(false);
         }
 #endif
-        memmove(&dest_buffer.messages_[dest_num], &buffer_.messages_[index],
-                num * sizeof(Message));
-        dest_buffer.set_num_elements(dest_num + num);
+        if (buffer_.sorted_)
+            dest_buffer.AppendRun(&buffer_.messages_[index], num);
+        else
+            dest_buffer.Append(&buffer_.messages_[index], num);
+        return true;
+    }
+
+    bool Node::WriteRun() {
+        RunFile* run = RunFile::Create(tree_->runDir_, buffer_.messages_,
+                buffer_.num_elements());
+        if (!run)
+            return false;
+        pthread_rwlock_wrlock(&tree_->treeLock_);
+        runFiles_.push_back(run);
+        buffer_.Deallocate();
+        pthread_rwlock_unlock(&tree_->treeLock_);
+
+        // tiers don't increase along runFiles_, so the newest runs are of
+        // the same tier if the first and last of them are
+        while (runFiles_.size() >= kRunsPerMerge) {
+            std::vector<RunFile*> newest(runFiles_.end() - kRunsPerMerge,
+                    runFiles_.end());
+            if (newest.front()->tier() != newest.back()->tier())
+                break;
+            RunFile* merged = RunFile::Merge(tree_->runDir_, newest);
+            if (!merged)
+                break;
+            pthread_rwlock_wrlock(&tree_->treeLock_);
+            runFiles_.resize(runFiles_.size() - kRunsPerMerge);
+            runFiles_.push_back(merged);
+            pthread_rwlock_unlock(&tree_->treeLock_);
+            for (uint32_t i = 0; i < newest.size(); ++i)
+                newest[i]->Unref();
+        }
+        return true;
+    }
+
+    bool Node::CompactRuns() {
+        if (!buffer_.empty()) {
+            if (!buffer_.sorted_) {
+                buffer_.Sort();
+                buffer_.Aggregate();
+            }
+            RunFile* run = RunFile::Create(tree_->runDir_, buffer_.messages_,
+                    buffer_.num_elements());
+            if (!run)
+                return false;
+            runFiles_.push_back(run);
+            buffer_.Deallocate();
+        }
+        if (runFiles_.size() > 1) {
+            RunFile* merged = RunFile::Merge(tree_->runDir_, runFiles_);
+            if (!merged)
+                return false;
+            for (uint32_t i = 0; i < runFiles_.size(); ++i)
+                runFiles_[i]->Unref();
+            runFiles_.assign(1, merged);
+        }
         return true;
     }
 
     bool Node::AddChild(Node* newNode) {
+        return AddChildren(std::vector<Node*>(1, newNode));
+    }
+
+    bool Node::AddChildren(const std::vector<Node*>& newNodes) {
         uint32_t i;
-        // insert separator value
+        // insert separator values
 
-        // find position of insertion
+        // find position of insertion; a splitting child may already have
+        // lowered its separator, so refresh the copies first
+        UpdateSeparators();
         std::vector<Node*>::iterator it = children_.begin();
-        for (i = 0; i < children_.size(); ++i) {
-            if (newNode->separator_ > children_[i]->separator_)
-                continue;
-            break;
-        }
+        i = std::lower_bound(separators_, separators_ + children_.size(),
+                newNodes.front()->separator_) - separators_;
         it += i;
-        children_.insert(it, newNode);
+        children_.insert(it, newNodes.begin(), newNodes.end());
+        UpdateSeparators();
 #ifdef CT_NODE_DEBUG
-        fprintf(stderr, "Node: %d: Node %d added at pos %u, [", id_,
-                newNode->id_, i);
+        fprintf(stderr, "Node: %d: %ld nodes added at pos %u, [", id_,
+                newNodes.size(), i);
         for (uint32_t j = 0; j < children_.size(); ++j)
             fprintf(stderr, "%d, ", children_[j]->id_);
         fprintf(stderr, "], num children: %ld\n", children_.size());
 #endif
         // set parent
-        newNode->parent_ = this;
+        for (uint32_t j = 0; j < newNodes.size(); ++j)
+            newNodes[j]->parent_ = this;
 
         return true;
     }
@@ -327,60 +547,115 @@ namespace gpucbt {
             assert(false);
         }
 #endif
-        // create new node
-        Node* newNode = new Node(tree_, level_);
-        // move the last floor((b+1)/2) children to new node
-        int newNodeChildIndex = (children_.size() + 1) / 2;
+        // split into as many nodes of at most b children as required, so a
+        // node that gained many children from multi-way leaf splits only
+        // needs to be split once
+        uint32_t num = children_.size();
+        uint32_t k = (num + tree_->b_ - 1) / tree_->b_;
+        if (k < 2)
+            k = 2;
+
+        std::vector<Node*> newNodes;
+        for (uint32_t j = 1; j < k; ++j) {
+            uint32_t start = j * num / k;
+            uint32_t end = (j + 1) * num / k;
 #ifdef ENABLE_ASSERT_CHECKS
-        if (children_[newNodeChildIndex]->separator_ <=
-                children_[newNodeChildIndex-1]->separator_) {
-            fprintf(stderr, "%d sep is %u and %d sep is %u\n",
-                    newNodeChildIndex,
-                    children_[newNodeChildIndex]->separator_,
-                    newNodeChildIndex-1,
-                    children_[newNodeChildIndex-1]->separator_);
-            assert(false);
-        }
+            if (children_[start]->separator_ <=
+                    children_[start - 1]->separator_) {
+                fprintf(stderr, "%d sep is %u and %d sep is %u\n",
+                        start, children_[start]->separator_,
+                        start - 1, children_[start - 1]->separator_);
+                assert(false);
+            }
 #endif
-        // add children to new node
-        for (uint32_t i = newNodeChildIndex; i < children_.size(); ++i) {
-            newNode->children_.push_back(children_[i]);
-            children_[i]->parent_ = newNode;
+            // create new node and add children to it
+            Node* newNode = new Node(tree_, level_);
+            for (uint32_t i = start; i < end; ++i) {
+                newNode->children_.push_back(children_[i]);
+                children_[i]->parent_ = newNode;
+            }
+            newNode->separator_ = newNode->children_.back()->separator_;
+            newNode->UpdateSeparators();
+            newNodes.push_back(newNode);
         }
         // set separator
-        newNode->separator_ = separator_;
+        newNodes.back()->separator_ = separator_;
 
         // remove children from current node
-        std::vector<Node*>::iterator it = children_.begin() +
-                newNodeChildIndex;
+        std::vector<Node*>::iterator it = children_.begin() + num / k;
         children_.erase(it, children_.end());
 
         // median separator from node
         separator_ = children_[children_.size()-1]->separator_;
+        UpdateSeparators();
 #ifdef CT_NODE_DEBUG
         fprintf(stderr, "After split, %d: [", id_);
         for (uint32_t j = 0; j < children_.size(); ++j)
             fprintf(stderr, "%u, ", children_[j]->separator_);
-        fprintf(stderr, "] and %d: [", newNode->id_);
-        for (uint32_t j = 0; j < newNode->children_.size(); ++j)
-            fprintf(stderr, "%u, ", newNode->children_[j]->separator_);
-        fprintf(stderr, "]\n");
-
-        fprintf(stderr, "Children, %d: [", id_);
-        for (uint32_t j = 0; j < children_.size(); ++j)
-            fprintf(stderr, "%d, ", children_[j]->id_);
-        fprintf(stderr, "] and %d: [", newNode->id_);
-        for (uint32_t j = 0; j < newNode->children_.size(); ++j)
-            fprintf(stderr, "%d, ", newNode->children_[j]->id_);
-        fprintf(stderr, "]\n");
+        fprintf(stderr, "]");
+        for (uint32_t i = 0; i < newNodes.size(); ++i) {
+            fprintf(stderr, " and %d: [", newNodes[i]->id_);
+            for (uint32_t j = 0; j < newNodes[i]->children_.size(); ++j)
+                fprintf(stderr, "%u, ",
+                        newNodes[i]->children_[j]->separator_);
+            fprintf(stderr, "]");
+        }
+        fprintf(stderr, "\n");
 #endif
 
         if (isRoot()) {
             buffer_.Deallocate();
-            return tree_->CreateNewRoot(newNode);
+            return tree_->CreateNewRoot(newNodes);
         } else {
-            return parent_->AddChild(newNode);
+            return parent_->AddChildren(newNodes);
+        }
+    }
+
+    void Node::UpdateSeparators() {
+        uint32_t num = children_.size();
+        uint32_t padded = (num + kSeparatorsPerVector - 1) /
+                kSeparatorsPerVector * kSeparatorsPerVector;
+        if (padded > separatorsCapacity_) {
+            free(separators_);
+            // grow geometrically; align to a cache line
+            separatorsCapacity_ = (padded > 2 * separatorsCapacity_?
+                    padded : 2 * separatorsCapacity_);
+            void* p;
+            if (posix_memalign(&p, 64, separatorsCapacity_ *
+                    sizeof(uint32_t))) {
+                fprintf(stderr, "Can't allocate separators for node %d\n",
+                        id_);
+                exit(-1);
+            }
+            separators_ = static_cast<uint32_t*>(p);
+        }
+        for (uint32_t i = 0; i < num; ++i)
+            separators_[i] = children_[i]->separator_;
+        for (uint32_t i = num; i < padded; ++i)
+            separators_[i] = UINT32_MAX;
+    }
+
+    uint32_t Node::findChild(uint32_t hash) const {
+        uint32_t num = children_.size();
+#ifdef __SSE2__
+        // count the separators <= hash; SSE2 only has signed compares, so
+        // flip the sign bits first
+        const __m128i sign = _mm_set1_epi32(0x80000000);
+        const __m128i h = _mm_xor_si128(_mm_set1_epi32(hash), sign);
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < num; i += kSeparatorsPerVector) {
+            __m128i s = _mm_xor_si128(_mm_load_si128(
+                    reinterpret_cast<const __m128i*>(separators_ + i)), sign);
+            int gt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(s, h)));
+            count += __builtin_popcount(~gt & 0xf);
         }
+#else
+        uint32_t count = std::upper_bound(separators_, separators_ + num,
+                hash) - separators_;
+#endif  // __SSE2__
+        // the last child's separator is UINT32_MAX, so the hash UINT32_MAX
+        // (and the padding) would otherwise index past the last child
+        return (count < num? count : num - 1);
     }
 
     bool Node::isFull() const {
@@ -434,6 +709,8 @@ namespace gpucbt {
     }
 
     void Node::schedule(const Action& act) {
+        if (act != NONE)
+            tree_->ActionScheduled();
         switch(act) {
             case SORT:
                 {
@@ -496,21 +773,81 @@ namespace gpucbt {
     }
 
     void Node::perform() {
+        // The tree keeps its shape while the lock is held shared. Buffers
+        // are only modified with their node's bufferMutex_ held, which is
+        // never held while the tree lock is waited for
+        pthread_rwlock_rdlock(&tree_->treeLock_);
         Action act = getQueueStatus();
         switch (act) {
             case SORT:
             case MERGE:
                 {
+                    // when partitioning, only leaves are sorted; input
+                    // buffers are leaves too, so check for them explicitly
+                    if (tree_->emptyMethod_ == PARTITION &&
+                            (act == SORT || !isLeaf()))
+                        break;
+                    pthread_mutex_lock(&bufferMutex_);
                     sortBuffer();
                     aggregateSortedBuffer();
+                    pthread_mutex_unlock(&bufferMutex_);
                 }
                 break;
             case EMPTY:
                 {
                     bool rootFlag = isRoot();
+                    // this may be called even when buffer is not full (when
+                    // flushing all buffers at the end)
+                    bool split = isLeaf() && (isFull() || rootFlag);
+                    pthread_mutex_lock(&bufferMutex_);
                     emptyBuffer();
-                    if (isLeaf())
-                        tree_->HandleFullLeaves();
+                    pthread_mutex_unlock(&bufferMutex_);
+                    // Split leaves can cause the number of children to
+                    // increase; the node is split like a leaf, with the tree
+                    // lock held exclusively
+                    if (!isLeaf() && children_.size() > tree_->b_) {
+                        pthread_rwlock_unlock(&tree_->treeLock_);
+                        pthread_rwlock_wrlock(&tree_->treeLock_);
+                        SplitNonLeaf();
+                        pthread_rwlock_unlock(&tree_->treeLock_);
+                        pthread_rwlock_rdlock(&tree_->treeLock_);
+                    }
+                    if (split && !rootFlag && tree_->ShouldWriteRun(this)) {
+                        // The leaf is still queued, so the buffer doesn't
+                        // change while it is written out unlocked. A leaf
+                        // with runs can't be split if that fails; it stays
+                        // full until the next attempt
+                        pthread_rwlock_unlock(&tree_->treeLock_);
+                        split = !WriteRun() && runFiles_.empty();
+                        pthread_rwlock_rdlock(&tree_->treeLock_);
+                    }
+                    if (split) {
+                        // Sibling leaves are emptied in parallel, and
+                        // splitting adds nodes to their parent and possibly
+                        // further up, so splits take the tree lock
+                        // exclusively. The leaf is still queued, so its
+                        // parent can't empty into it in the meantime.
+                        pthread_rwlock_unlock(&tree_->treeLock_);
+                        pthread_rwlock_wrlock(&tree_->treeLock_);
+#ifdef CT_NODE_DEBUG
+                        fprintf(stderr, "Splitting leaf node %d %u/%u\n",
+                                id_, buffer_.num_elements(),
+                                Buffer::kEmptyThreshold);
+#endif
+                        // a single multi-way split leaves every piece below
+                        // the emptying threshold, however overfull the leaf
+                        // was
+                        bool spill = !SplitLeaf() && isFull() && !rootFlag;
+                        pthread_rwlock_unlock(&tree_->treeLock_);
+                        // A heavy-key leaf that is still full once it has
+                        // been aggregated holds that many colliding keys.
+                        // Rather than let its parent overflow it, its buffer
+                        // is chained on as a run; a leaf with runs takes
+                        // the path above from then on
+                        if (spill)
+                            WriteRun();
+                        pthread_rwlock_rdlock(&tree_->treeLock_);
+                    }
                     setQueueStatus(NONE);
                     if (rootFlag) {
                         tree_->sorter_->SubmitNextNodeForEmptying();
@@ -523,6 +860,12 @@ namespace gpucbt {
                 }
                 break;
         }
+        pthread_rwlock_unlock(&tree_->treeLock_);
+        if (act == EMPTY) {
+            pthread_mutex_lock(&tree_->flushProgressMutex_);
+            pthread_cond_broadcast(&tree_->flushProgress_);
+            pthread_mutex_unlock(&tree_->flushProgressMutex_);
+        }
     }
 }
 
@@ -38,6 +38,7 @@ namespace gpucbt {
     class Emptier;
     class Compressor;
     class Merger;
+    class RunFile;
 
     enum Action {
         SORT,
@@ -62,6 +63,7 @@ namespace gpucbt {
         /* copy user data into buffer. Buffer should be decompressed
            before calling. */
         bool insert(const Message& msg);
+        bool insert(const Message* msgs, uint32_t num);
 
         // identification functions
         bool isLeaf() const;
@@ -72,6 +74,11 @@ namespace gpucbt {
         uint32_t id() const;
 
       private:
+        static const uint32_t kWriteCombineSize;
+        static const uint32_t kSeparatorsPerVector;
+        /* Number of runs of the same tier that are merged into one */
+        static const uint32_t kRunsPerMerge;
+
         /* Buffer handling functions */
 
         bool EmptyIfNecessary();
@@ -81,14 +88,17 @@ namespace gpucbt {
          *  + Must be called with buffer decompressed.
          *  + Buffer will be freed after invocation.
          *  + If children buffers overflow, it recursively calls itself.
-         *    until the recursion reaches the leaves. At this stage, handling
-         *    the leaf buffer overflows is queued for later because this may
-         *    cause splitting (recursively) up the tree which is best done
-         *    when no internal nodes are over-full.
-         *  + an emptyBuffer() invocation should be followed by a
-         *    handleFullLeaves() call.
+         *    until the recursion reaches the leaves.
+         *  + Full leaves, and nodes with too many children, are not split
+         *    here but by perform(), which needs to hold the tree lock
+         *    exclusively for that.
          */
         bool emptyBuffer();
+        /* Used instead of splitting a sorted buffer when the tree's
+         * EmptyMethod is PARTITION: scatter the (unsorted) buffer to the
+         * children in one pass, staging kWriteCombineSize messages per child
+         * so that writes to child buffers are done in large blocks. */
+        void partitionBuffer();
         /* Sort the root buffer based on hash value. All other nodes can
          * aggregating by merging. */
         bool sortBuffer();
@@ -102,8 +112,21 @@ namespace gpucbt {
 
         /* Tree-related functions */
 
-        /* split leaf node and return new leaf */
-        Node* SplitLeaf();
+        /* split leaf node into as many leaves as needed to bring each to
+         * half the emptying threshold, cutting heavy-key runs out into
+         * their own leaves; returns false if the leaf couldn't be split */
+        bool SplitLeaf();
+        /* Used instead of SplitLeaf() once the leaf level is kept on disk,
+         * or for a full heavy-key leaf: write the sorted, aggregated buffer
+         * out as another run of the leaf (in memory if there is no leaf
+         * tier) and merge the leaf's newest runs while kRunsPerMerge of
+         * them are of the same tier. Called without the tree lock while
+         * the leaf is queued. Returns false, keeping the buffer, if the run
+         * can't be written */
+        bool WriteRun();
+        /* Merge the buffer and the runs of a leaf that has written runs
+         * into a single run. Called while the slaves are idle */
+        bool CompactRuns();
         /* Add a new child to the node; the child type indicates which side
          * of the separator the child must be inserted.
          * if the number of children is more than the allowed number:
@@ -111,9 +134,19 @@ namespace gpucbt {
          * + if not, split the node into two and call addChild recursively
          */
         bool AddChild(Node* newNode);
-        /* Split non-leaf node; must be called with the buffer decompressed
-         * and sorted. If called on the root, then a new root is created */
+        /* Add several new children at once. The new nodes must be sorted
+         * by separator and cover a contiguous range of hashes */
+        bool AddChildren(const std::vector<Node*>& newNodes);
+        /* Split non-leaf node into nodes of at most b children; must be
+         * called with the buffer decompressed and sorted. If called on the
+         * root, then a new root is created */
         bool SplitNonLeaf();
+        /* Rebuild separators_ from the children. Must be called whenever
+         * children are added or removed, or a child's separator changes. */
+        void UpdateSeparators();
+        /* Index of the child whose range covers hash, i.e. of the first
+         * separator strictly greater than hash */
+        uint32_t findChild(uint32_t hash) const;
         //
         // management of queues
         //
@@ -136,7 +169,11 @@ namespace gpucbt {
         CompressTree* tree_;
         /* Buffer */
         Buffer buffer_;
-        pthread_mutex_t stateMutex_;
+        /* Held while the buffer is modified in place, by the slave working
+         * on the node or by the parent being emptied into it, and by
+         * Lookup() while it probes the buffer. Changes to the shape of the
+         * tree are made with treeLock_ held exclusively instead */
+        pthread_mutex_t bufferMutex_;
         uint32_t id_;
         /* level in the tree; 0 at leaves and increases upwards */
         uint32_t level_;
@@ -146,6 +183,23 @@ namespace gpucbt {
         /* Pointers to children */
         std::vector<Node*> children_;
         uint32_t separator_;
+        /* Copy of the children's separators, kept contiguous (and padded
+         * with UINT32_MAX to a multiple of kSeparatorsPerVector) so that
+         * child lookups don't touch the child nodes */
+        uint32_t* separators_;
+        uint32_t separatorsCapacity_;
+        /* partitionBuffer()'s write-combining area: kWriteCombineSize
+         * messages for each of up to stagedCapacity_ children. Allocated on
+         * the first partition */
+        Message* staged_;
+        uint32_t stagedCapacity_;
+        /* Leaf holding a single (aggregated) hash value. It can't be split;
+         * once full, its buffer is written out as a run instead */
+        bool heavy_;
+        /* Runs written out by the leaf, covering its whole hash range, in
+         * order of non-increasing tier. Only changed while the leaf is
+         * queued, with the tree lock held exclusively */
+        std::vector<RunFile*> runFiles_;
 
         // Queueing related status, condition variables and mutexes
         enum Action queueStatus_;
@@ -123,7 +123,12 @@ namespace gpucbt {
             // If parent is present, it must be in the disabled queue.
             // remove n from its parent's dependency list
             if (n->parent_ && n->parent_->getQueueStatus() == EMPTY) {
-                std::set<uint32_t>* ch = disabNodes_[n->parent_];
+                // the parent may have been enabled already if n wasn't
+                // queued when the parent was inserted
+                DisabledDAG::iterator t = disabNodes_.find(n->parent_);
+                if (t == disabNodes_.end())
+                    return;
+                std::set<uint32_t>* ch = t->second;
                 std::set<uint32_t>::iterator it = ch->find(n->id());
                 if (it != ch->end()) { // found
                     ch->erase(it);
@@ -137,8 +142,7 @@ namespace gpucbt {
                     enabNodes_.push(np);
 
                     delete ch;
-                    DisabledDAG::iterator t = disabNodes_.find(n->parent_);
-                    disabNodes_.erase(t); 
+                    disabNodes_.erase(t);
                 }
             }
             
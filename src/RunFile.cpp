@@ -0,0 +1,237 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#define __STDC_FORMAT_MACROS
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "RunFile.h"
+#include "SegmentMerger.h"
+
+namespace gpucbt {
+    const uint32_t RunFile::kWriteChunkSize = 65536;
+    pthread_mutex_t RunFile::refMutex_ = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t RunFile::fileCtr_ = 0;
+
+    RunFile::RunFile(const std::string& dir, uint32_t tier) :
+            file_(NULL),
+            messages_(NULL),
+            num_(0),
+            mapSize_(0),
+            tier_(tier),
+            refs_(1) {
+        if (dir.empty())
+            return;
+        pthread_mutex_lock(&refMutex_);
+        uint64_t n = fileCtr_++;
+        pthread_mutex_unlock(&refMutex_);
+        char name[64];
+        snprintf(name, sizeof(name), "/ct-%d-%" PRIu64 ".run", getpid(), n);
+        path_ = dir + name;
+    }
+
+    RunFile::~RunFile() {
+        if (file_)
+            fclose(file_);
+        if (messages_)
+            munmap(const_cast<Message*>(messages_), mapSize_);
+        if (!path_.empty())
+            unlink(path_.c_str());
+    }
+
+    bool RunFile::Open(uint64_t max) {
+        if (path_.empty()) {
+            if (max == 0)
+                return true;
+            void* p = mmap(NULL, max * sizeof(Message),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                    0);
+            if (p == MAP_FAILED) {
+                perror("RunFile: allocating run failed");
+                return false;
+            }
+            messages_ = static_cast<const Message*>(p);
+            mapSize_ = max * sizeof(Message);
+            return true;
+        }
+        file_ = fopen(path_.c_str(), "wb");
+        if (!file_)
+            perror("RunFile: opening run failed");
+        return (file_ != NULL);
+    }
+
+    bool RunFile::Write(const Message* msgs, uint64_t num) {
+        if (!file_) {
+            std::copy(msgs, msgs + num, const_cast<Message*>(messages_) + num_);
+            num_ += num;
+            return true;
+        }
+        if (fwrite(msgs, sizeof(Message), num, file_) != num) {
+            perror("RunFile: writing run failed");
+            return false;
+        }
+        num_ += num;
+        return true;
+    }
+
+    bool RunFile::Close() {
+        if (!file_) {
+            // memory runs are as immutable as mapped files
+            if (messages_)
+                mprotect(const_cast<Message*>(messages_), mapSize_,
+                        PROT_READ);
+            return true;
+        }
+        bool ok = (fclose(file_) == 0);
+        file_ = NULL;
+        if (!ok) {
+            perror("RunFile: writing run failed");
+            return false;
+        }
+        if (num_ == 0)
+            return true;
+        int fd = open(path_.c_str(), O_RDONLY);
+        if (fd < 0) {
+            perror("RunFile: opening run failed");
+            return false;
+        }
+        void* p = mmap(NULL, num_ * sizeof(Message), PROT_READ, MAP_SHARED,
+                fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            perror("RunFile: mapping run failed");
+            return false;
+        }
+        messages_ = static_cast<const Message*>(p);
+        mapSize_ = num_ * sizeof(Message);
+        return true;
+    }
+
+    RunFile* RunFile::Create(const std::string& dir, const Message* msgs,
+            uint64_t num) {
+        RunFile* run = new RunFile(dir, 0);
+        if (!run->Open(num) || !run->Write(msgs, num) || !run->Close()) {
+            delete run;
+            return NULL;
+        }
+        return run;
+    }
+
+    RunFile* RunFile::Merge(const std::string& dir,
+            const std::vector<RunFile*>& runs) {
+        SegmentMerger merge;
+        uint32_t tier = 0;
+        uint64_t max = 0;
+        for (uint32_t i = 0; i < runs.size(); ++i) {
+            merge.Add(runs[i]->begin(), runs[i]->end());
+            tier = std::max(tier, runs[i]->tier() + 1);
+            max += runs[i]->size();
+        }
+        // aggregation can only shrink the runs; pages of a memory run past
+        // the merged messages are never touched
+        RunFile* run = new RunFile(dir, tier);
+        if (!run->Open(max)) {
+            delete run;
+            return NULL;
+        }
+        std::vector<Message> chunk;
+        chunk.reserve(kWriteChunkSize);
+        bool ok = true;
+        Message msg;
+        while (ok) {
+            bool more = merge.Next(msg);
+            if (more)
+                chunk.push_back(msg);
+            if (chunk.size() == kWriteChunkSize ||
+                    (!more && !chunk.empty())) {
+                ok = run->Write(&chunk[0], chunk.size());
+                chunk.clear();
+            }
+            if (!more)
+                break;
+        }
+        if (!ok || !run->Close()) {
+            delete run;
+            return NULL;
+        }
+        return run;
+    }
+
+    void RunFile::Ref() {
+        pthread_mutex_lock(&refMutex_);
+        refs_++;
+        pthread_mutex_unlock(&refMutex_);
+    }
+
+    void RunFile::Unref() {
+        pthread_mutex_lock(&refMutex_);
+        bool last = (--refs_ == 0);
+        pthread_mutex_unlock(&refMutex_);
+        if (last)
+            delete this;
+    }
+
+    const Message* RunFile::begin() const {
+        return messages_;
+    }
+
+    const Message* RunFile::end() const {
+        return messages_ + num_;
+    }
+
+    uint64_t RunFile::size() const {
+        return num_;
+    }
+
+    uint32_t RunFile::tier() const {
+        return tier_;
+    }
+
+    namespace {
+        struct HashLess {
+            bool operator()(const Message& m, uint32_t hash) const {
+                return (m.hash() < hash);
+            }
+        };
+    }
+
+    void RunFile::Lookup(const Message& msg, Message& result,
+            bool& found) const {
+        const Message* m = std::lower_bound(begin(), end(), msg.hash(),
+                HashLess());
+        for (; m < end() && m->hash() == msg.hash(); ++m) {
+            // the mapping is read-only
+            Message cand = *m;
+            if (!cand.SameKey(msg))
+                continue;
+            if (found) {
+                result.Merge(cand);
+            } else {
+                result = cand;
+                found = true;
+            }
+        }
+    }
+}
@@ -0,0 +1,94 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef SRC_RUNFILE_H_
+#define SRC_RUNFILE_H_
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "Message.h"
+
+namespace gpucbt {
+    /* An immutable run of messages, sorted by hash and aggregated, kept in
+     * a file and used in place through a read-only mapping, or in memory
+     * if no directory is given. Runs are reference counted: the file is
+     * unmapped and removed when the last reference is dropped. */
+    class RunFile {
+      public:
+        /* Write msgs to a new run file in directory dir, or to memory if
+         * dir is empty. Returns NULL, leaving no file behind, if it can't
+         * be written */
+        static RunFile* Create(const std::string& dir, const Message* msgs,
+                uint64_t num);
+        /* Merge runs into a new run in dir (or memory), one tier above the
+         * highest of theirs. The runs are left as they are */
+        static RunFile* Merge(const std::string& dir,
+                const std::vector<RunFile*>& runs);
+
+        /* Created runs start with one reference */
+        void Ref();
+        void Unref();
+
+        const Message* begin() const;
+        const Message* end() const;
+        uint64_t size() const;
+        /* 0 for runs that were written out, one more than their inputs'
+         * for merged runs */
+        uint32_t tier() const;
+
+        /* Same as Buffer::Lookup() */
+        void Lookup(const Message& msg, Message& result, bool& found) const;
+
+      private:
+        /* Messages written per call when merging */
+        static const uint32_t kWriteChunkSize;
+        static pthread_mutex_t refMutex_;
+        // numbers run files, so that a name is never reused while a run
+        // may still be referenced. refMutex_ protected
+        static uint64_t fileCtr_;
+
+        RunFile(const std::string& dir, uint32_t tier);
+        ~RunFile();
+        /* Open the file, or map memory for up to max messages, for
+         * writing */
+        bool Open(uint64_t max);
+        /* Append num messages to the run being written */
+        bool Write(const Message* msgs, uint64_t num);
+        /* Map the messages written to the file, or make the memory they
+         * were written to read-only */
+        bool Close();
+
+        // empty for runs kept in memory
+        std::string path_;
+        // file being written
+        FILE* file_;
+        const Message* messages_;
+        uint64_t num_;
+        // bytes mapped at messages_
+        uint64_t mapSize_;
+        uint32_t tier_;
+        // refMutex_ protected
+        uint32_t refs_;
+    };
+}
+
+#endif  // SRC_RUNFILE_H_
@@ -0,0 +1,87 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "SegmentMerger.h"
+
+namespace gpucbt {
+    void SegmentMerger::Add(const Message* begin, const Message* end) {
+        if (begin == end)
+            return;
+        Head h = {begin->hash(), static_cast<uint32_t>(cur_.size())};
+        cur_.push_back(begin);
+        end_.push_back(end);
+        heads_.push(h);
+    }
+
+    bool SegmentMerger::Next(Message& msg) {
+        if (group_.empty())
+            NextGroup();
+        if (group_.empty())
+            return false;
+        msg = group_.back();
+        group_.pop_back();
+        return true;
+    }
+
+    bool SegmentMerger::empty() const {
+        return (group_.empty() && heads_.empty());
+    }
+
+    uint32_t SegmentMerger::num_segments() const {
+        return cur_.size();
+    }
+
+    void SegmentMerger::Clear() {
+        cur_.clear();
+        end_.clear();
+        while (!heads_.empty())
+            heads_.pop();
+        group_.clear();
+    }
+
+    void SegmentMerger::NextGroup() {
+        if (heads_.empty())
+            return;
+        uint32_t hash = heads_.top().hash;
+        while (!heads_.empty() && heads_.top().hash == hash) {
+            Head h = heads_.top();
+            heads_.pop();
+            const Message* m = cur_[h.segment];
+            const Message* end = end_[h.segment];
+            for (; m < end && m->hash() == hash; ++m) {
+                // messages with colliding hashes can be interleaved
+                uint32_t i = 0;
+                for (; i < group_.size(); ++i) {
+                    if (group_[i].SameKey(*m)) {
+                        group_[i].Merge(*m);
+                        break;
+                    }
+                }
+                if (i == group_.size())
+                    group_.push_back(*m);
+            }
+            cur_[h.segment] = m;
+            if (m < end) {
+                h.hash = m->hash();
+                heads_.push(h);
+            }
+        }
+    }
+}
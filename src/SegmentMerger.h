@@ -0,0 +1,66 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef SRC_SEGMENTMERGER_H_
+#define SRC_SEGMENTMERGER_H_
+#include <stdint.h>
+#include <queue>
+#include <vector>
+#include "Message.h"
+
+namespace gpucbt {
+    /* k-way merge of segments of messages, each sorted by hash, that
+     * aggregates messages with the same key on the way. The segments
+     * aren't copied and must stay unchanged until the merge is done. */
+    class SegmentMerger {
+      public:
+        /* Add the messages in [begin, end) to the merge */
+        void Add(const Message* begin, const Message* end);
+        /* Set msg to the next aggregate. Returns false, leaving msg
+         * unchanged, once all aggregates have been handed out */
+        bool Next(Message& msg);
+        /* true once all aggregates have been handed out */
+        bool empty() const;
+        uint32_t num_segments() const;
+        void Clear();
+
+      private:
+        struct Head {
+            uint32_t hash;
+            uint32_t segment;
+        };
+        struct HeadCompare {
+            bool operator()(const Head& lhs, const Head& rhs) const {
+                return (lhs.hash > rhs.hash);
+            }
+        };
+        /* Aggregate all messages with the next smallest hash into group_ */
+        void NextGroup();
+
+        // next and end positions of every segment
+        std::vector<const Message*> cur_;
+        std::vector<const Message*> end_;
+        std::priority_queue<Head, std::vector<Head>, HeadCompare> heads_;
+        // aggregates for the current hash that haven't been handed out yet
+        std::vector<Message> group_;
+    };
+}
+
+#endif  // SRC_SEGMENTMERGER_H_
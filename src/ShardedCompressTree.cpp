@@ -0,0 +1,210 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <unistd.h>
+
+#include "ShardedCompressTree.h"
+
+namespace gpucbt {
+    ShardedCompressTree::ShardedCompressTree(uint32_t num_shards, uint32_t b,
+            uint32_t buffer_size, EmptyMethod method,
+            FinalizeMethod finalize) :
+            numInserted_(num_shards, 0),
+            readShard_(0) {
+        // each shard gets its own slice of the cores; if there are fewer
+        // cores than shards, shards share cores round-robin
+        uint32_t numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shardLocks_ = new pthread_mutex_t[num_shards];
+        pthread_mutex_init(&scatterMutex_, NULL);
+        for (uint32_t i = 0; i < num_shards; ++i) {
+            CompressTree* tree = new CompressTree(b, buffer_size, method,
+                    finalize);
+            std::vector<uint32_t> cpus;
+            if (numCpus >= num_shards) {
+                for (uint32_t c = i * numCpus / num_shards;
+                        c < (i + 1) * numCpus / num_shards; ++c)
+                    cpus.push_back(c);
+            } else if (numCpus > 0) {
+                cpus.push_back(i % numCpus);
+            }
+            if (!cpus.empty())
+                tree->SetAffinity(cpus);
+            shards_.push_back(tree);
+            pthread_mutex_init(&shardLocks_[i], NULL);
+        }
+    }
+
+    ShardedCompressTree::~ShardedCompressTree() {
+        for (uint32_t i = 0; i < shards_.size(); ++i) {
+            delete shards_[i];
+            pthread_mutex_destroy(&shardLocks_[i]);
+        }
+        delete[] shardLocks_;
+        for (uint32_t i = 0; i < scatterBatches_.size(); ++i) {
+            ScatterBatches* scatter = scatterBatches_[i];
+            for (uint32_t s = 0; s < scatter->batches.size(); ++s) {
+                if (scatter->batches[s])
+                    CompressTree::FreeBatch(scatter->batches[s]);
+            }
+            delete scatter;
+        }
+        pthread_mutex_destroy(&scatterMutex_);
+    }
+
+    uint32_t ShardedCompressTree::ShardOf(uint32_t hash) const {
+        return (static_cast<uint64_t>(hash) * shards_.size()) >> 32;
+    }
+
+    bool ShardedCompressTree::insert(const Message& msg) {
+        uint32_t s = ShardOf(msg.hash());
+        pthread_mutex_lock(&shardLocks_[s]);
+        numInserted_[s]++;
+        bool ret = shards_[s]->insert(msg);
+        pthread_mutex_unlock(&shardLocks_[s]);
+        return ret;
+    }
+
+    ShardedCompressTree::ScatterBatches*
+            ShardedCompressTree::GetScatterBatches() {
+        ScatterBatches* scatter = NULL;
+        pthread_mutex_lock(&scatterMutex_);
+        if (!scatterBatches_.empty()) {
+            scatter = scatterBatches_.back();
+            scatterBatches_.pop_back();
+        }
+        pthread_mutex_unlock(&scatterMutex_);
+        if (!scatter) {
+            // batches are only allocated for the shards that get messages
+            scatter = new ScatterBatches();
+            scatter->batches.resize(shards_.size(), NULL);
+            scatter->sizes.resize(shards_.size(), 0);
+        }
+        return scatter;
+    }
+
+    void ShardedCompressTree::PutScatterBatches(ScatterBatches* scatter) {
+        pthread_mutex_lock(&scatterMutex_);
+        scatterBatches_.push_back(scatter);
+        pthread_mutex_unlock(&scatterMutex_);
+    }
+
+    bool ShardedCompressTree::bulk_insert(const Message* msgs, uint64_t num) {
+        // scatter the messages by shard, keeping their order, so that each
+        // shard takes its share a batch at a time
+        ScatterBatches* scatter = GetScatterBatches();
+        std::vector<Message*>& batches = scatter->batches;
+        std::vector<uint32_t>& sizes = scatter->sizes;
+        uint32_t maxBatchSize = CompressTree::MaxBatchSize();
+        bool ret = true;
+        for (uint64_t i = 0; i < num; ++i) {
+            uint32_t s = ShardOf(msgs[i].hash());
+            if (!batches[s])
+                batches[s] = CompressTree::AllocateBatch();
+            batches[s][sizes[s]++] = msgs[i];
+            if (sizes[s] < maxBatchSize)
+                continue;
+            // the shard takes over a full batch without copying it
+            pthread_mutex_lock(&shardLocks_[s]);
+            numInserted_[s] += sizes[s];
+            ret = shards_[s]->bulk_insert_owned(batches[s], sizes[s]) && ret;
+            pthread_mutex_unlock(&shardLocks_[s]);
+            batches[s] = NULL;
+            sizes[s] = 0;
+        }
+        for (uint32_t s = 0; s < shards_.size(); ++s) {
+            if (sizes[s] == 0)
+                continue;
+            pthread_mutex_lock(&shardLocks_[s]);
+            numInserted_[s] += sizes[s];
+            ret = shards_[s]->bulk_insert(batches[s], sizes[s]) && ret;
+            pthread_mutex_unlock(&shardLocks_[s]);
+            sizes[s] = 0;
+        }
+        PutScatterBatches(scatter);
+        return ret;
+    }
+
+    bool ShardedCompressTree::Lookup(const Message& msg, Message& result) {
+        return shards_[ShardOf(msg.hash())]->Lookup(msg, result);
+    }
+
+    void ShardedCompressTree::SkipEmptyShards() {
+        while (readShard_ < shards_.size() && numInserted_[readShard_] == 0)
+            readShard_++;
+    }
+
+    bool ShardedCompressTree::nextValue(Message& msg) {
+        SkipEmptyShards();
+        if (readShard_ == shards_.size()) {
+            readShard_ = 0;
+            return false;
+        }
+        if (shards_[readShard_]->nextValue(msg))
+            return true;
+        // msg is the shard's last value; the shard has been emptied
+        numInserted_[readShard_++] = 0;
+        SkipEmptyShards();
+        if (readShard_ < shards_.size())
+            return true;
+        readShard_ = 0;
+        return false;
+    }
+
+    bool ShardedCompressTree::bulk_read(Message* msgs, uint64_t& num_read,
+            uint64_t max) {
+        num_read = 0;
+        while (num_read < max) {
+            if (!nextValue(msgs[num_read]))
+                return false;
+            num_read++;
+        }
+        return true;
+    }
+
+    bool ShardedCompressTree::ReadSpan(MessageSpan& span, uint32_t max) {
+        while (true) {
+            SkipEmptyShards();
+            if (readShard_ == shards_.size()) {
+                readShard_ = 0;
+                span.messages = NULL;
+                span.num = 0;
+                return false;
+            }
+            if (shards_[readShard_]->ReadSpan(span, max)) {
+                spanShards_.push_back(readShard_);
+                return true;
+            }
+            // the shard is emptied once its spans are released
+            numInserted_[readShard_++] = 0;
+        }
+    }
+
+    void ShardedCompressTree::ReleaseSpan() {
+        if (spanShards_.empty())
+            return;
+        uint32_t s = spanShards_.front();
+        spanShards_.pop_front();
+        shards_[s]->ReleaseSpan();
+    }
+
+    uint32_t ShardedCompressTree::num_shards() const {
+        return shards_.size();
+    }
+}
@@ -0,0 +1,97 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef SRC_SHARDEDCOMPRESSTREE_H_
+#define SRC_SHARDEDCOMPRESSTREE_H_
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include "CompressTree.h"
+#include "Message.h"
+
+namespace gpucbt {
+    /* Several independent trees, each with its own buffers, root emptying
+     * pipeline and slaves, which are pinned to a share of the cores. The
+     * hash space is cut into num_shards equal slices and a message goes to
+     * the tree of its slice, i.e. by the top bits of its hash if
+     * num_shards is a power of two. As the slices are in hash order,
+     * reading the trees one after the other yields all aggregates in hash
+     * order. */
+    class ShardedCompressTree {
+      public:
+        /* num_shards must be at least 1 */
+        ShardedCompressTree(uint32_t num_shards, uint32_t b,
+                uint32_t buffer_size, EmptyMethod method = SORT_AND_SPLIT,
+                FinalizeMethod finalize = FLUSH_TO_LEAVES);
+        ~ShardedCompressTree();
+
+        /* Inserter side. Unlike with a single tree, these can be called
+         * from several threads at once; a shard only takes messages from
+         * one of them at a time */
+        bool insert(const Message& msg);
+        bool bulk_insert(const Message* msgs, uint64_t num);
+        /* Doesn't wait for the shard's inserters */
+        bool Lookup(const Message& msg, Message& result);
+
+        /* Reader side. Read the shards in turn, as with the CompressTree
+         * functions of the same names. Must not be called concurrently
+         * with inserts */
+        bool nextValue(Message& msg);
+        bool bulk_read(Message* msgs, uint64_t& num_read, uint64_t max);
+        bool ReadSpan(MessageSpan& span, uint32_t max = 0);
+        void ReleaseSpan();
+
+        uint32_t num_shards() const;
+
+      private:
+        /* Batches, one per shard, that bulk_insert() scatters messages
+         * into. Only full batches are handed over to the shards; the rest
+         * is copied out, and the batches are kept for the next call */
+        struct ScatterBatches {
+            std::vector<Message*> batches;
+            std::vector<uint32_t> sizes;
+        };
+
+        uint32_t ShardOf(uint32_t hash) const;
+        /* Take a set of batches that no other inserter is using */
+        ScatterBatches* GetScatterBatches();
+        void PutScatterBatches(ScatterBatches* scatter);
+        /* Move the read cursor past shards with nothing to read */
+        void SkipEmptyShards();
+
+        std::vector<CompressTree*> shards_;
+        // one per shard, held while inserting into it
+        pthread_mutex_t* shardLocks_;
+        // sets of batches not in use by an inserter
+        std::vector<ScatterBatches*> scatterBatches_;
+        pthread_mutex_t scatterMutex_;
+        // messages inserted into each shard since it was last read; a
+        // shard that hasn't been inserted into may not even have been set
+        // up, so it isn't read
+        std::vector<uint64_t> numInserted_;
+        // shard being read
+        uint32_t readShard_;
+        // shards of the spans handed out and not yet released, oldest first
+        std::deque<uint32_t> spanShards_;
+    };
+}
+
+#endif  // SRC_SHARDEDCOMPRESSTREE_H_
@@ -118,6 +118,12 @@ namespace gpucbt {
         pthread_spin_unlock(&maskLock_);
     }
 
+    inline void Slave::setThreadAwake(uint32_t ind) {
+        pthread_spin_lock(&maskLock_);
+        tmask_ &= ~(1 << ind);
+        pthread_spin_unlock(&maskLock_);
+    }
+
     // TODO: Using a naive method for now
     inline uint32_t Slave::getNumberOfSleepingThreads() {
         uint32_t c;
@@ -131,13 +137,11 @@ namespace gpucbt {
 
     void Slave::checkSendCompletionNotice() {
         pthread_mutex_lock(&completionMutex_);
-        if (askForCompletionNotice_) {
-            // can signal only if I'm the last thread awake so I check if the
-            // number of sleeping threads is numThreads_ - 1
-            if (getNumberOfSleepingThreads() == (numThreads_ - 1)) {
-                pthread_cond_signal(&complete_);
-                askForCompletionNotice_ = false;
-            }
+        // the calling thread is already marked as sleeping, so this holds
+        // only for the last thread to go to sleep
+        if (askForCompletionNotice_ && empty()) {
+            pthread_cond_broadcast(&complete_);
+            askForCompletionNotice_ = false;
         }
         pthread_mutex_unlock(&completionMutex_);
     }
@@ -156,12 +160,14 @@ namespace gpucbt {
     }
 
     void Slave::WaitUntilCompletionNoticeReceived() {
+        // threads check for the request under completionMutex_ after they
+        // have marked themselves as sleeping, so no notice can be missed
+        pthread_mutex_lock(&completionMutex_);
         while (!empty()) {
-            pthread_mutex_lock(&completionMutex_);
             askForCompletionNotice_ = true;
             pthread_cond_wait(&complete_, &completionMutex_);
-            pthread_mutex_unlock(&completionMutex_);
         }
+        pthread_mutex_unlock(&completionMutex_);
     }
 
     void* Slave::callHelper(void* arg) {
@@ -175,21 +181,28 @@ namespace gpucbt {
         // Things get messed up if some workers enter before all are created
         pthread_barrier_wait(&tree_->threadsBarrier_);
 
-        while (!More()) {
-            // check if anybody wants a notification when list is empty
-            checkSendCompletionNotice();
+        while (true) {
+            // The thread is marked as sleeping before it checks for work and
+            // keeps its mutex until it waits, so a Wakeup() that follows
+            // AddNode() either finds the work queued here or its signal
+            // finds the thread waiting.
+            pthread_mutex_lock(&(me->mutex_));
+            while (true) {
+                setThreadSleep(me->index_);
+                if (More() || checkInputComplete())
+                    break;
+                // check if anybody wants a notification when list is empty
+                checkSendCompletionNotice();
 
 #ifdef CT_NODE_DEBUG
-            fprintf(stderr, "%s (%d) sleeping\n", GetSlaveName().c_str(),
-                    me->index_);
+                fprintf(stderr, "%s (%d) sleeping\n", GetSlaveName().c_str(),
+                        me->index_);
 #endif  // CT_NODE_DEBUG
 
-            // mark thread as sleeping in mask
-            setThreadSleep(me->index_);
-
-            // sleep until woken up
-            pthread_mutex_lock(&(me->mutex_));
-            pthread_cond_wait(&(me->hasWork_), &(me->mutex_));
+                // sleep until woken up
+                pthread_cond_wait(&(me->hasWork_), &(me->mutex_));
+            }
+            setThreadAwake(me->index_);
             pthread_mutex_unlock(&(me->mutex_));
 
 #ifdef CT_NODE_DEBUG
@@ -210,6 +223,8 @@ namespace gpucbt {
                 PrintElements();
 #endif
                 Work(n);
+                // anything n led to has been scheduled by now
+                tree_->ActionPerformed();
             }
             if (checkInputComplete())
                 break;
@@ -245,6 +260,10 @@ namespace gpucbt {
         pthread_attr_t attr;
         numThreads_ = num;
         pthread_attr_init(&attr);
+        if (tree_->pinThreads_) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+                    &tree_->affinity_);
+        }
         for (uint32_t i = 0; i < numThreads_; ++i) {
             ThreadStruct* t = new ThreadStruct();
             t->index_ = i;
@@ -303,6 +322,14 @@ namespace gpucbt {
     }
 
     void Sorter::AddToSorted(Node* n) {
+        // submitting swaps buffers with the root. The first submission is
+        // always made from here; if it pre-splits the tree, the tree's
+        // shape changes, so the tree lock is taken exclusively
+        bool presplit = tree_->presplitPending_;
+        if (presplit)
+            pthread_rwlock_wrlock(&tree_->treeLock_);
+        else
+            pthread_rwlock_rdlock(&tree_->treeLock_);
         // pick up the lock so no sorted node can be picked up
         // for emptying
         pthread_mutex_lock(&sortedNodesMutex_);
@@ -319,11 +346,16 @@ namespace gpucbt {
             sortedNodes_.push_back(n);
         }
         pthread_mutex_unlock(&sortedNodesMutex_);
+        pthread_rwlock_unlock(&tree_->treeLock_);
     }
 
     void Sorter::SubmitNextNodeForEmptying() {
         pthread_mutex_lock(&sortedNodesMutex_);
-        if (!sortedNodes_.empty()) {
+        // If the root was split while it was emptied, AddToSorted() may
+        // already have submitted a node to the new root. It picks up the
+        // next node once it has been emptied.
+        if (!sortedNodes_.empty() &&
+                tree_->rootNode_->getQueueStatus() == NONE) {
             Node* n = sortedNodes_.front();
             sortedNodes_.pop_front();
             tree_->SubmitNodeForEmptying(n);
@@ -368,16 +400,13 @@ namespace gpucbt {
 #ifdef CT_NODE_DEBUG
         assert(n->getQueueStatus() == EMPTY);
 #endif  // CT_NODE_DEBUG
-        bool is_root = n->isRoot();
-
         n->perform();
 
-        // No other node is dependent on the root. Performing this check also
-        // avoids the problem, where perform() causes the creation of a new
-        // root which is immediately submitted for emptying. In a regular case,
-        // a parent of n would be in the disabled queue, but in this case it is
-        // not.
-        if (!is_root) {
+        // No other node is dependent on the root. If perform() split the
+        // root, the new root may already have been submitted for emptying
+        // and be waiting on n in the disabled queue, so n is checked once it
+        // is done
+        if (!n->isRoot()) {
             // possibly enable parent etc.
             pthread_spin_lock(&nodesLock_);
             queue_.post(n);
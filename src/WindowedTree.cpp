@@ -0,0 +1,145 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "WindowedTree.h"
+
+namespace gpucbt {
+    WindowedTree::WindowedTree(uint32_t b, uint32_t buffer_size,
+            EmptyMethod method, FinalizeMethod finalize) :
+            active_(0),
+            epoch_(0),
+            numInserted_(0),
+            closed_(false),
+            shutdown_(false),
+            closedTree_(NULL),
+            closedEpoch_(0),
+            closedEmpty_(false),
+            closedTreeEpoch_(0) {
+        for (uint32_t i = 0; i < 2; ++i) {
+            trees_[i] = new CompressTree(b, buffer_size, method, finalize);
+            trees_[i]->SetRecycle(true);
+        }
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&epochRead_, NULL);
+        pthread_cond_init(&epochClosed_, NULL);
+    }
+
+    WindowedTree::~WindowedTree() {
+        delete trees_[0];
+        delete trees_[1];
+        pthread_mutex_destroy(&mutex_);
+        pthread_cond_destroy(&epochRead_);
+        pthread_cond_destroy(&epochClosed_);
+    }
+
+    bool WindowedTree::insert(const Message& msg) {
+        numInserted_++;
+        return trees_[active_]->insert(msg);
+    }
+
+    bool WindowedTree::bulk_insert(const Message* msgs, uint64_t num) {
+        numInserted_ += num;
+        return trees_[active_]->bulk_insert(msgs, num);
+    }
+
+    uint64_t WindowedTree::epoch() const {
+        return epoch_;
+    }
+
+    bool WindowedTree::CloseEpoch(bool block) {
+        pthread_mutex_lock(&mutex_);
+        if (closed_ && !block) {
+            pthread_mutex_unlock(&mutex_);
+            return false;
+        }
+        // the other tree is free once the previous epoch has been read
+        while (closed_)
+            pthread_cond_wait(&epochRead_, &mutex_);
+        closedTree_ = trees_[active_];
+        closedEpoch_ = epoch_;
+        closedEmpty_ = (numInserted_ == 0);
+        closedTreeEpoch_ = closedTree_->epoch();
+        closed_ = true;
+        pthread_cond_broadcast(&epochClosed_);
+        pthread_mutex_unlock(&mutex_);
+
+        active_ ^= 1;
+        epoch_++;
+        numInserted_ = 0;
+        return true;
+    }
+
+    bool WindowedTree::WaitForClosedEpoch(uint64_t& epoch) {
+        pthread_mutex_lock(&mutex_);
+        while (!closed_ && !shutdown_)
+            pthread_cond_wait(&epochClosed_, &mutex_);
+        bool ret = closed_;
+        if (ret)
+            epoch = closedEpoch_;
+        pthread_mutex_unlock(&mutex_);
+        return ret;
+    }
+
+    bool WindowedTree::nextValue(Message& msg) {
+        // an empty tree may not even have been set up, so don't read it
+        bool ret = !closedEmpty_ && closedTree_->nextValue(msg);
+        CheckRead();
+        return ret;
+    }
+
+    bool WindowedTree::bulk_read(Message* msgs, uint64_t& num_read,
+            uint64_t max) {
+        num_read = 0;
+        bool ret = !closedEmpty_ && closedTree_->bulk_read(msgs, num_read,
+                max);
+        CheckRead();
+        return ret;
+    }
+
+    bool WindowedTree::ReadSpan(MessageSpan& span, uint32_t max) {
+        bool ret = !closedEmpty_ && closedTree_->ReadSpan(span, max);
+        CheckRead();
+        return ret;
+    }
+
+    void WindowedTree::ReleaseSpan() {
+        closedTree_->ReleaseSpan();
+        CheckRead();
+    }
+
+    void WindowedTree::Shutdown() {
+        pthread_mutex_lock(&mutex_);
+        shutdown_ = true;
+        pthread_cond_broadcast(&epochClosed_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    void WindowedTree::CheckRead() {
+        if (!closedEmpty_ && closedTree_->epoch() == closedTreeEpoch_)
+            return;
+        pthread_mutex_lock(&mutex_);
+        closed_ = false;
+        // don't report the empty epoch as read again
+        closedEmpty_ = false;
+        closedTreeEpoch_ = closedTree_->epoch();
+        pthread_cond_broadcast(&epochRead_);
+        pthread_mutex_unlock(&mutex_);
+    }
+}
@@ -0,0 +1,95 @@
+// Copyright (C) 2012 Georgia Institute of Technology
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef SRC_WINDOWEDTREE_H_
+#define SRC_WINDOWEDTREE_H_
+#include <pthread.h>
+#include <stdint.h>
+#include "CompressTree.h"
+#include "Message.h"
+
+namespace gpucbt {
+    /* Tumbling-window aggregation. Inserts go to the current epoch; closing
+     * it starts the next epoch right away, in a second tree, while the
+     * closed epoch is read, possibly by another thread. The two trees take
+     * turns and are recycled (see CompressTree::SetRecycle()), so their
+     * slave threads stay up from window to window, and buffer memory is
+     * passed between them through Buffer's array pool. */
+    class WindowedTree {
+      public:
+        WindowedTree(uint32_t b, uint32_t buffer_size,
+                EmptyMethod method = SORT_AND_SPLIT,
+                FinalizeMethod finalize = FLUSH_TO_LEAVES);
+        ~WindowedTree();
+
+        /* Inserter side. Add to the current epoch */
+        bool insert(const Message& msg);
+        bool bulk_insert(const Message* msgs, uint64_t num);
+        /* The epoch being inserted into */
+        uint64_t epoch() const;
+        /* End the current epoch and start the next one. Only one closed
+         * epoch is kept: if the previous one hasn't been read completely,
+         * this blocks until it has or, if block is false, returns false
+         * without closing the epoch. */
+        bool CloseEpoch(bool block = true);
+
+        /* Reader side. Wait until there is a closed epoch to read and
+         * return its number. Returns false once Shutdown() has been called
+         * and all closed epochs have been read. */
+        bool WaitForClosedEpoch(uint64_t& epoch);
+        /* Read the closed epoch, as with the CompressTree functions of the
+         * same names. The epoch has been read, and the next one can be
+         * closed, once they return false and all spans are released. */
+        bool nextValue(Message& msg);
+        bool bulk_read(Message* msgs, uint64_t& num_read, uint64_t max);
+        bool ReadSpan(MessageSpan& span, uint32_t max = 0);
+        void ReleaseSpan();
+        void Shutdown();
+
+      private:
+        /* Called after every read; hands the closed tree back once it has
+         * been reset */
+        void CheckRead();
+
+        CompressTree* trees_[2];
+        // tree taking inserts
+        uint32_t active_;
+        uint64_t epoch_;
+        uint64_t numInserted_;
+
+        pthread_mutex_t mutex_;
+        pthread_cond_t epochRead_;
+        pthread_cond_t epochClosed_;
+        // mutex_ protection begin
+        // set from CloseEpoch() until the closed epoch has been read
+        bool closed_;
+        bool shutdown_;
+        // mutex_ protection end
+        CompressTree* closedTree_;
+        uint64_t closedEpoch_;
+        // set if nothing was inserted in the closed epoch
+        bool closedEmpty_;
+        // closedTree_->epoch() at the time of closing; it changes when the
+        // tree is reset at the end of the read
+        uint64_t closedTreeEpoch_;
+    };
+}
+
+#endif  // SRC_WINDOWEDTREE_H_